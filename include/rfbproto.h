@@ -194,7 +194,8 @@ typedef char rfbProtocolVersionMsg[13];	/* allow extra byte for null */
  * of supported security types, or informs the client about an error (when the
  * number of security types is 0).  Security type rfbSecTypeTight is used to
  * enable TightVNC-specific protocol extensions.  The value rfbSecTypeVncAuth
- * stands for classic VNC authentication.
+ * stands for classic VNC authentication, and rfbSecTypeVeNCrypt for TLS
+ * followed by one of the VeNCrypt sub-types below.
  *
  * The client selects a particular security type from the list provided by the
  * server.
@@ -204,6 +205,26 @@ typedef char rfbProtocolVersionMsg[13];	/* allow extra byte for null */
 #define rfbSecTypeNone 1
 #define rfbSecTypeVncAuth 2
 #define rfbSecTypeTight 16
+#define rfbSecTypeVeNCrypt 19
+
+/*
+ * VeNCrypt (version 0.2).  The server sends its version as two bytes, the
+ * client replies with the version it wants, and the server sends a byte
+ * which is 0 if that is acceptable.  The server then sends a count and that
+ * many CARD32 sub-types, and the client sends the CARD32 sub-type it has
+ * chosen.  For the TLS sub-types the server replies with a byte which is 1
+ * if the choice is accepted, after which the TLS handshake takes place and
+ * the rest of the session, including the inner authentication, is
+ * encrypted.  The rfbVeNCryptTLS* sub-types use anonymous Diffie-Hellman;
+ * the rfbVeNCryptX509* ones use a server certificate.
+ */
+
+#define rfbVeNCryptTLSNone 257
+#define rfbVeNCryptTLSVnc 258
+#define rfbVeNCryptTLSPlain 259
+#define rfbVeNCryptX509None 260
+#define rfbVeNCryptX509Vnc 261
+#define rfbVeNCryptX509Plain 262
 
 
 /*-----------------------------------------------------------------------------
@@ -386,6 +407,8 @@ typedef struct _rfbInteractionCapsMsg {
 #define rfbSetColourMapEntries 1
 #define rfbBell 2
 #define rfbServerCutText 3
+#define rfbEndOfContinuousUpdates 150
+#define rfbServerFence 248
 
 #define rfbFileListData 130
 #define rfbFileDownloadData 131
@@ -408,6 +431,9 @@ typedef struct _rfbInteractionCapsMsg {
 #define rfbKeyEvent 4
 #define rfbPointerEvent 5
 #define rfbClientCutText 6
+#define rfbEnableContinuousUpdates 150
+#define rfbClientFence 248
+#define rfbSetScale 8			/* UltraVNC */
 
 #define rfbFileListRequest 130
 #define rfbFileDownloadRequest 131
@@ -481,6 +507,15 @@ typedef struct _rfbInteractionCapsMsg {
 #define rfbEncodingLastRect        0xFFFFFF20
 #define rfbEncodingNewFBSize       0xFFFFFF21
 
+/* Pseudo-encoding for desktops made of several screens, with a reason and
+   status for each size change. */
+#define rfbEncodingExtendedDesktopSize 0xFFFFFECC
+
+/* Pseudo-encodings from TigerVNC, advertising the Fence and
+   ContinuousUpdates messages. */
+#define rfbEncodingFence             0xFFFFFEC8
+#define rfbEncodingContinuousUpdates 0xFFFFFEC7
+
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
 #define rfbEncodingQualityLevel2   0xFFFFFFE2
@@ -854,6 +889,39 @@ typedef struct _rfbXCursorColors {
  */
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * NewFBSize and ExtendedDesktopSize pseudo-encodings.  The server's desktop
+ * has changed size to (r.w, r.h).  NewFBSize has no data.  For
+ * ExtendedDesktopSize, r.x holds the reason for the change and r.y a status
+ * which is non-zero only when a client's request to resize was refused, in
+ * which case the size has not changed.  An rfbExtDesktopSizeHeader follows,
+ * then one rfbScreenDesc for each screen.
+ */
+
+#define rfbExtDesktopSizeServer 0	/* reasons */
+#define rfbExtDesktopSizeClient 1
+#define rfbExtDesktopSizeOtherClient 2
+
+typedef struct _rfbExtDesktopSizeHeader {
+    CARD8 nScreens;
+    CARD8 pad1;
+    CARD16 pad2;
+} rfbExtDesktopSizeHeader;
+
+#define sz_rfbExtDesktopSizeHeader 4
+
+typedef struct _rfbScreenDesc {
+    CARD32 id;
+    CARD16 x;
+    CARD16 y;
+    CARD16 width;
+    CARD16 height;
+    CARD32 flags;
+} rfbScreenDesc;
+
+#define sz_rfbScreenDesc 16
+
+
 /*-----------------------------------------------------------------------------
  * SetColourMapEntries - these messages are only sent if the pixel
  * format uses a "colour map" (i.e. trueColour false) and the client has not
@@ -904,6 +972,46 @@ typedef struct _rfbServerCutTextMsg {
 
 #define sz_rfbServerCutTextMsg 8
 
+
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates - sent once when the server first sees the
+ * ContinuousUpdates pseudo-encoding, to say that it supports them, and again
+ * whenever the client turns continuous updates off.
+ */
+
+typedef struct _rfbEndOfContinuousUpdatesMsg {
+    CARD8 type;			/* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg 1
+
+
+/*-----------------------------------------------------------------------------
+ * Fence - a synchronisation point in the message stream.  The same message
+ * is used in both directions.  If the request flag is set, the receiver must
+ * send the fence back with the request flag cleared, the other flags reduced
+ * to those it understands, and the same payload.  A server which supports
+ * fences sends one as soon as it sees the Fence pseudo-encoding.
+ */
+
+typedef struct _rfbFenceMsg {
+    CARD8 type;			/* rfbServerFence or rfbClientFence */
+    CARD8 pad1;
+    CARD16 pad2;
+    CARD32 flags;
+    CARD8 length;
+    /* followed by char data[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg 9
+
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter  0x00000002
+#define rfbFenceFlagSyncNext    0x00000004
+#define rfbFenceFlagRequest     0x80000000
+
+#define rfbFenceMaxPayload 64
+
 /*-----------------------------------------------------------------------------
  * FileListData
  */
@@ -972,6 +1080,8 @@ typedef union _rfbServerToClientMsg {
     rfbSetColourMapEntriesMsg scme;
     rfbBellMsg b;
     rfbServerCutTextMsg sct;
+    rfbEndOfContinuousUpdatesMsg eocu;
+    rfbFenceMsg f;
     rfbFileListDataMsg fld;
     rfbFileDownloadDataMsg fdd;
     rfbFileUploadCancelMsg fuc;
@@ -1057,6 +1167,42 @@ typedef struct _rfbFramebufferUpdateRequestMsg {
 #define sz_rfbFramebufferUpdateRequestMsg 10
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - with enable set, the server sends updates for
+ * the given rectangle whenever it changes, without waiting for
+ * FramebufferUpdateRequests.  With enable clear it stops doing so, and
+ * replies with EndOfContinuousUpdates.  The client may only send this once
+ * the server has sent EndOfContinuousUpdates.
+ */
+
+typedef struct _rfbEnableContinuousUpdatesMsg {
+    CARD8 type;			/* always rfbEnableContinuousUpdates */
+    CARD8 enable;
+    CARD16 x;
+    CARD16 y;
+    CARD16 w;
+    CARD16 h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
+/*-----------------------------------------------------------------------------
+ * SetScale - UltraVNC's request for the server to divide the size of its
+ * desktop by scale.  The server reports the new size with NewFBSize, and
+ * from then on all coordinates, in both directions, are in the scaled
+ * desktop.  Servers which don't know this message close the connection.
+ */
+
+typedef struct _rfbSetScaleMsg {
+    CARD8 type;			/* always rfbSetScale */
+    CARD8 scale;
+    CARD16 pad;
+} rfbSetScaleMsg;
+
+#define sz_rfbSetScaleMsg 4
+
+
 /*-----------------------------------------------------------------------------
  * KeyEvent - key press or release
  *
@@ -1239,6 +1385,9 @@ typedef union _rfbClientToServerMsg {
     rfbFixColourMapEntriesMsg fcme;
     rfbSetEncodingsMsg se;
     rfbFramebufferUpdateRequestMsg fur;
+    rfbEnableContinuousUpdatesMsg ecu;
+    rfbSetScaleMsg ss;
+    rfbFenceMsg f;
     rfbKeyEventMsg ke;
     rfbPointerEventMsg pe;
     rfbClientCutTextMsg cct;
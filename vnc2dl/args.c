@@ -58,10 +58,30 @@ AppData appData = {
    0,       // int rawDelay;
    0,       // int copyRectDelay;
    0,       // Bool debug;
-   0,       // int compressLevel;
-   0,       // int qualityLevel;
-   0,       // Bool enableJPEG;
+   -1,      // int compressLevel;
+   -1,      // int qualityLevel;
+   1,       // Bool enableJPEG;
    0,       // Bool autoPass;
+   0,       // Bool pipeline;
+   0,       // Bool ioUring;
+   0,       // char *listenUnix;
+   0,       // char *fbFile;
+   40,      // int fbInterval;
+   0,       // int rcvBuf;
+   0,       // Bool quickAck;
+   0,       // int statsInterval;
+   0,       // char *x509CA;
+   0,       // Bool noTLS;
+   0,       // Bool noContinuous;
+   0,       // Bool noAutoSelect;
+   0,       // int viewportX;
+   0,       // int viewportY;
+   0,       // Bool followPointer;
+   1,       // Bool useRemoteCursor;
+   2000,    // int refineDelay;
+   0,       // int stripes;
+   0,       // int scale;
+   NULL,    // char *controlPath;
 };
 
 
@@ -77,12 +97,34 @@ static struct option long_options[] = {
   {"encodings",    required_argument,    NULL,                    'e'},
   {"bgr233",       no_argument,          &appData.useBGR233,      1},
   {"depth",        required_argument,    NULL,                    'd'},
-  {"compresslevel",required_argument,    &appData.compressLevel,  'c'},
-  {"quality",      required_argument,    &appData.qualityLevel,   'q'},
+  {"compresslevel",required_argument,    NULL,                    'c'},
+  {"quality",      required_argument,    NULL,                    'q'},
   {"nojpeg",       no_argument,          &appData.enableJPEG,     0},
+  {"refine",       required_argument,    NULL,                    'r'},
+  {"nocursorshape",no_argument,          &appData.useRemoteCursor, 0},
   {"autopass",     no_argument,          &appData.autoPass,       1},
   {"listen",       no_argument,          &appData.listen,         1},
   {"listenPort",   required_argument,    NULL,                    'L'},
+  {"listenUnix",   required_argument,    NULL,                    'U'},
+  {"fbfile",       required_argument,    NULL,                    'F'},
+  {"fbinterval",   required_argument,    NULL,                    'I'},
+  {"rcvbuf",       required_argument,    NULL,                    'R'},
+  {"quickack",     no_argument,          &appData.quickAck,       1},
+  {"stats",        required_argument,    NULL,                    'S'},
+  {"x509ca",       required_argument,    NULL,                    'X'},
+  {"notls",        no_argument,          &appData.noTLS,          1},
+  {"nocontinuous", no_argument,          &appData.noContinuous,   1},
+  {"noautoselect", no_argument,          &appData.noAutoSelect,   1},
+  {"viewport",     required_argument,    NULL,                    'V'},
+  {"follow",       no_argument,          &appData.followPointer,  1},
+  {"region",       required_argument,    NULL,                    'G'},
+  {"rate",         required_argument,    NULL,                    'P'},
+  {"stripes",      required_argument,    NULL,                    'N'},
+  {"scale",        required_argument,    NULL,                    'Z'},
+  {"control",      required_argument,    NULL,                    'K'},
+  {"bandwidth",    required_argument,    NULL,                    'W'},
+  {"pipeline",     no_argument,          &appData.pipeline,       1},
+  {"iouring",      no_argument,          &appData.ioUring,        1},
   {0,              0,                      0,                     0}
 };
 
@@ -99,7 +141,10 @@ usage(void)
 	  "\n"
 	  "Usage: %s [<OPTIONS>] [<HOST>][:<DISPLAY#>]\n"
 	  "       %s [<OPTIONS>] [<HOST>][::<PORT#>]\n"
+	  "       %s [<OPTIONS>] unix:<SOCKET-PATH>\n"
 	  "       %s [<OPTIONS>] -listen [-listenPort <PORT#>]\n"
+	  "       %s [<OPTIONS>] -listenUnix <SOCKET-PATH>\n"
+	  "       %s [<OPTIONS>] -fbfile <XWD-FILE> [-fbinterval <MS>]\n"
 	  "       %s -help\n"
 	  "\n"
 	  "<OPTIONS> include:\n"
@@ -108,16 +153,37 @@ usage(void)
 	  "        -noshared\n"
 	  "        -passwd <PASSWD-FILENAME> (standard VNC authentication)\n"
 	  "        -encodings <ENCODING-LIST> (e.g. \"tight copyrect\")\n"
+	  "        -noautoselect (don't adapt encodings to the link speed)\n"
+	  "        -viewport <X>,<Y> (part of a large desktop to show)\n"
+	  "        -follow (move the viewport to follow the server's pointer)\n"
+	  "        -region <X>,<Y>,<W>x<H>@<HZ>|auto@<HZ> (poll part of the screen at its own rate)\n"
+	  "        -rate <HZ> (poll the rest of the screen this often)\n"
 	  "        -depth <DEPTH>\n"
 	  "        -compresslevel <COMPRESS-VALUE> (0..9: 0-fast, 9-best)\n"
 	  "        -quality <JPEG-QUALITY-VALUE> (0..9: 0-low, 9-high)\n"
 	  "        -nojpeg\n"
+	  "        -refine <MS> (resend JPEG areas exactly once still; 0 = never)\n"
+	  "        -nocursorshape (let the server draw its cursor)\n"
 	  "        -autopass\n"
 	  "        -listen\n"
   	  "        -listenPort <PORTNUM>\n"
+	  "        -listenUnix <SOCKET-PATH>\n"
+	  "        -x509ca <CA-FILE> (verify the server's TLS certificate)\n"
+	  "        -notls (don't use VeNCrypt even if the server offers it)\n"
+	  "        -rcvbuf <KBYTES>|auto (socket receive buffer size)\n"
+	  "        -quickack (acknowledge received data immediately)\n"
+	  "        -stats <SECONDS> (print receive statistics periodically)\n"
+	  "        -nocontinuous (request each update, even if the server can stream them)\n"
+	  "        -pipeline (decode and drive the device in separate threads)\n"
+	  "        -iouring (receive from the server through io_uring)\n"
+	  "        -stripes <N> (decode N bands of the screen on N connections)\n"
+	  "        -scale <N>|auto (have an UltraVNC server shrink its desktop)\n"
+	  "        -control <SOCKET-PATH> (take commands to change settings)\n"
+	  "        -bandwidth <KBIT/S> (receive no more than this from the server)\n"
 	  "\n"
 	  "See the manual page for more information."
-	  "\n", programName, programName, programName, programName);
+	  "\n", programName, programName, programName, programName, programName,
+	  programName, programName);
   exit(1);
 }
 
@@ -137,7 +203,7 @@ ProcessArgs(int argc, char **argv)
   int option_index = 0;
 
   while (1) {
-      int c = getopt_long_only(argc, argv, "p:e:d:c:q:L:", long_options, &option_index);
+      int c = getopt_long_only(argc, argv, "p:e:d:c:q:r:L:U:F:I:R:S:X:V:G:P:N:Z:K:W:", long_options, &option_index);
    
       if (c == -1)  break; /* end of options */
       
@@ -176,23 +242,139 @@ ProcessArgs(int argc, char **argv)
           appData.qualityLevel = atoi(optarg);
           printf ("Quality level set to `%s'\n", optarg);
           break;
+
+          case 'r':
+          appData.refineDelay = atoi(optarg);
+          if (appData.refineDelay < 0)
+            usage();
+          printf ("Refinement delay set to %dms\n", appData.refineDelay);
+          break;
           
           case 'L':
           appData.listenPort = atoi(optarg);
           printf ("Listening port set to %d\n", appData.listenPort);
           break;
+
+          case 'U':
+          appData.listen = True;
+          appData.listenUnix = strdup(optarg);
+          printf ("Listening on socket `%s'\n", optarg);
+          break;
+
+          case 'F':
+          appData.fbFile = strdup(optarg);
+          printf ("Framebuffer file set to `%s'\n", optarg);
+          break;
+
+          case 'I':
+          appData.fbInterval = atoi(optarg);
+          if (appData.fbInterval <= 0)
+            usage();
+          printf ("Framebuffer poll interval set to %dms\n", appData.fbInterval);
+          break;
+
+          case 'R':
+          if (strcmp(optarg, "auto") == 0) {
+            appData.rcvBuf = -1;
+            printf ("Receive buffer left to the kernel's tuning\n");
+          } else {
+            appData.rcvBuf = atoi(optarg);
+            if (appData.rcvBuf <= 0)
+              usage();
+            printf ("Receive buffer set to %dKB\n", appData.rcvBuf);
+          }
+          break;
+
+          case 'S':
+          appData.statsInterval = atoi(optarg);
+          if (appData.statsInterval <= 0)
+            usage();
+          printf ("Printing receive statistics every %ds\n", appData.statsInterval);
+          break;
+
+          case 'X':
+          appData.x509CA = strdup(optarg);
+          printf ("Server certificates will be checked against `%s'\n", optarg);
+          break;
+
+          case 'V':
+          if (sscanf(optarg, "%d,%d", &appData.viewportX, &appData.viewportY) != 2)
+            usage();
+          printf ("Viewport origin set to (%d, %d)\n", appData.viewportX, appData.viewportY);
+          break;
+
+          case 'G':
+          if (!AddPollRegion(optarg))
+            usage();
+          appData.noContinuous = True;
+          printf ("Polling region `%s'\n", optarg);
+          break;
+
+          case 'P':
+          if (atoi(optarg) <= 0)
+            usage();
+          SetPollRate(atoi(optarg));
+          appData.noContinuous = True;
+          printf ("Polling the screen at %sHz\n", optarg);
+          break;
+
+          case 'N':
+          appData.stripes = atoi(optarg);
+          if (appData.stripes < 1 || appData.stripes > MAX_STRIPES)
+            usage();
+          printf ("Using %d connections\n", appData.stripes);
+          break;
+
+          case 'Z':
+          if (strcmp(optarg, "auto") == 0)
+            appData.scale = -1;
+          else if ((appData.scale = atoi(optarg)) < 1 || appData.scale > 255)
+            usage();
+          break;
+
+          case 'K':
+          appData.controlPath = strdup(optarg);
+          break;
+
+          case 'W':
+          if (atoi(optarg) <= 0)
+            usage();
+          SetBandwidth(atoi(optarg));
+          appData.noContinuous = True;
+          printf ("Bandwidth limited to %skbit/s\n", optarg);
+          break;
           
           default:
           usage();
           break;
       }
   }
+
+  /* The other connections of a striped session have no timers (see
+     stripes.c), so the features which need them are turned off. */
+  if (appData.stripes > 1) {
+      if (appData.listen || appData.fbFile || scheduling) {
+          fprintf(stderr,"-stripes cannot be used with -listen, -fbfile, "
+                  "-region or -rate\n");
+          usage();
+      }
+      appData.shareDesktop = True;
+      appData.noContinuous = True;
+      appData.noAutoSelect = True;
+      appData.useRemoteCursor = False;
+      appData.refineDelay = 0;
+  }
   
   if (appData.listen) {
       vncServerName = "Incoming";
       if (argc != optind) {
           usage();
       }
+  } else if (appData.fbFile) {
+      vncServerName = "Local";
+      if (argc != optind) {
+          usage();
+      }
   } else {
       if (argc == 1) {
         usage();
@@ -211,7 +393,11 @@ ProcessArgs(int argc, char **argv)
       }
 
       colonPos = strchr(vncServerName, ':');
-      if (colonPos == NULL) {
+      if (IsUnixHost(vncServerName)) {
+        /* Unix-domain socket -- keep the whole name, there's no port */
+        strcpy(vncServerHost, vncServerName);
+        vncServerPort = 0;
+      } else if (colonPos == NULL) {
         /* No colon -- use default port number */
         strcpy(vncServerHost, vncServerName);
         vncServerPort = SERVER_PORT_OFFSET;
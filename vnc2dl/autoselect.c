@@ -0,0 +1,275 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * autoselect.c - choose encodings to suit the link to the server.
+ *
+ * Unless -encodings or -noautoselect is given, we watch the connection
+ * during the session and put it in one of three classes.  Each class has its
+ * own encoding order and compression and JPEG quality levels.  When the class
+ * changes, SetEncodings is sent again.
+ *
+ * Throughput is measured over framebuffer updates only, so an idle screen
+ * doesn't look like a slow link, and only against the time spent waiting
+ * for the server to send more (see RFBWaitUs).  Decoding and drawing the
+ * update don't count, or a compressed encoding on a fast link would look
+ * slow, be compressed harder and look slower still.  Small updates are
+ * ignored because latency dominates them.  The round trip time is the
+ * kernel's TCP estimate, which, unlike a fence, isn't held up behind
+ * updates we have yet to decode.
+ *
+ * The classes overlap: a link has to get clearly better or worse to move,
+ * and it has to stay that way for AUTO_STABLE_PERIODS periods in a row.
+ */
+
+#include <vnc2dl.h>
+
+#define AUTO_PERIOD_MS 2000
+#define AUTO_STABLE_PERIODS 3
+#define AUTO_MIN_UPDATE (16*1024)	/* bytes */
+#define AUTO_MIN_BYTES (256*1024)	/* per period, for a throughput figure */
+#define AUTO_NUM_ENCODINGS 7
+
+/* Thresholds for moving into a class, and for staying there. */
+#define FAST_ENTER_MBPS 50.0
+#define FAST_ENTER_RTT 5
+#define FAST_LEAVE_MBPS 25.0
+#define FAST_LEAVE_RTT 10
+#define SLOW_ENTER_MBPS 4.0
+#define SLOW_ENTER_RTT 150
+#define SLOW_LEAVE_MBPS 8.0
+#define SLOW_LEAVE_RTT 100
+
+enum { LINK_SLOW, LINK_MEDIUM, LINK_FAST };
+
+static struct {
+  const char *name;
+  CARD32 encodings[AUTO_NUM_ENCODINGS];	/* most preferred first */
+  int compressLevel;
+  int qualityLevel;
+} linkClasses[] = {
+  { "slow",
+    { rfbEncodingCopyRect, rfbEncodingTight, rfbEncodingZlib,
+      rfbEncodingHextile, rfbEncodingCoRRE, rfbEncodingRRE,
+      rfbEncodingRaw },
+    9, 4 },
+  { "medium",
+    { rfbEncodingCopyRect, rfbEncodingTight, rfbEncodingHextile,
+      rfbEncodingZlib, rfbEncodingCoRRE, rfbEncodingRRE,
+      rfbEncodingRaw },
+    3, 7 },
+  { "fast",
+    { rfbEncodingRaw, rfbEncodingCopyRect, rfbEncodingHextile,
+      rfbEncodingRRE, rfbEncodingCoRRE, rfbEncodingTight,
+      rfbEncodingZlib },
+    1, 9 },
+};
+
+Bool autoSelect = False;
+
+static int periodTimer = 0;
+static int linkClass;
+static int candidateClass;
+static int candidatePeriods = 0;
+
+/* Measurements for the current period. */
+static unsigned long periodBytes = 0;
+static long long periodUs = 0;
+
+static long long updateStartUs;
+static unsigned long updateStartBytes;
+
+
+/*
+ * Decide which class the latest figures put the link in.  Either may be -1
+ * if we have no measurement.  The thresholds depend on the current class,
+ * so that a link near a boundary doesn't keep crossing it.
+ */
+
+static int
+ClassifyLink(double mbps, long rtt)
+{
+  Bool fromSlow = (linkClass == LINK_SLOW);
+  Bool fromFast = (linkClass == LINK_FAST);
+  double slowMbps = fromSlow ? SLOW_LEAVE_MBPS : SLOW_ENTER_MBPS;
+  long slowRtt = fromSlow ? SLOW_LEAVE_RTT : SLOW_ENTER_RTT;
+  double fastMbps = fromFast ? FAST_LEAVE_MBPS : FAST_ENTER_MBPS;
+  long fastRtt = fromFast ? FAST_LEAVE_RTT : FAST_ENTER_RTT;
+
+  if (mbps < 0 && rtt < 0)
+    return linkClass;
+
+  if ((mbps >= 0 && mbps < slowMbps) || rtt > slowRtt)
+    return LINK_SLOW;
+
+  /* Without a throughput figure (nothing much changed on the screen) we can
+     stay fast, but not become fast. */
+  if (rtt <= fastRtt && (mbps >= fastMbps || (mbps < 0 && fromFast)))
+    return LINK_FAST;
+
+  return LINK_MEDIUM;
+}
+
+
+/*
+ * AutoSelectPeriod runs on a timer, classifies the link on what was seen
+ * since last time, and changes encodings if the class has been different
+ * for long enough.
+ */
+
+static void
+AutoSelectPeriod(void *data)
+{
+  double mbps = -1;
+  long rtt = RFBRoundTripMs();
+  int target;
+
+  /* Turned off from the control socket (see control.c). */
+  if (!autoSelect)
+    return;
+
+  /* If we never had to wait, the link kept ahead of us. */
+  if (periodBytes >= AUTO_MIN_BYTES)
+    mbps = periodUs > 0 ? periodBytes * 8.0 / periodUs : FAST_ENTER_MBPS;
+
+  /* The link is no faster than we are allowed to use (see bandwidth.c). */
+  if (BandwidthMbps() >= 0 && (mbps < 0 || mbps > BandwidthMbps()))
+    mbps = BandwidthMbps();
+
+  target = ClassifyLink(mbps, rtt);
+
+  if (appData.debug)
+    fprintf(stderr,"Link: %.1f Mbit/s, RTT %ldms, looks %s\n",
+	    mbps, rtt, linkClasses[target].name);
+
+  periodBytes = 0;
+  periodUs = 0;
+
+  /* Make sure the kernel has a fresh round trip time for next time. */
+  if (!ProbeRoundTrip()) {
+    QuitEventLoop();
+    return;
+  }
+
+  if (target == linkClass) {
+    candidatePeriods = 0;
+    return;
+  }
+  if (target != candidateClass) {
+    candidateClass = target;
+    candidatePeriods = 0;
+  }
+  if (++candidatePeriods < AUTO_STABLE_PERIODS)
+    return;
+
+  linkClass = target;
+  candidatePeriods = 0;
+  fprintf(stderr,"Link now looks %s (%.1f Mbit/s, RTT %ldms): "
+	  "changing encodings\n", linkClasses[linkClass].name, mbps, rtt);
+
+  if (!SendEncodings())
+    QuitEventLoop();
+}
+
+
+/*
+ * StartAutoSelect picks a class from what we know about the connection
+ * before anything has been measured, and starts the measurement timer.
+ */
+
+void
+StartAutoSelect(void)
+{
+  autoSelect = True;
+
+  if (BandwidthMbps() >= 0 && BandwidthMbps() < SLOW_ENTER_MBPS)
+    linkClass = LINK_SLOW;
+  else if (SameMachine(rfbsock) && !tunnelSpecified)
+    linkClass = LINK_FAST;
+  else
+    linkClass = LINK_MEDIUM;
+  candidateClass = linkClass;
+
+  fprintf(stderr,"Assuming a %s link to start with\n",
+	  linkClasses[linkClass].name);
+
+  if (!periodTimer)
+    periodTimer = AddTimer(AUTO_PERIOD_MS, True, AutoSelectPeriod, NULL);
+}
+
+
+/*
+ * AutoSelectEncodings fills in encs, in network byte order, with the
+ * encodings and pseudo-encodings for the current class.  Encodings we can't
+ * decode are skipped.  Returns the number used, at most max.
+ */
+
+int
+AutoSelectEncodings(CARD32 *encs, int max)
+{
+  CARD32 e;
+  int i, n = 0;
+
+  for (i = 0; i < AUTO_NUM_ENCODINGS && n < max; i++) {
+    e = linkClasses[linkClass].encodings[i];
+    if (EncodingSupported(e))
+      encs[n++] = Swap32IfLE(e);
+  }
+
+  if (n < max)
+    encs[n++] = Swap32IfLE(rfbEncodingCompressLevel0 +
+			   linkClasses[linkClass].compressLevel);
+
+  if (appData.enableJPEG && n < max)
+    encs[n++] = Swap32IfLE(rfbEncodingQualityLevel0 +
+			   linkClasses[linkClass].qualityLevel);
+
+  return n;
+}
+
+
+/*
+ * AutoSelectUpdateStart and AutoSelectUpdateEnd bracket each framebuffer
+ * update.  Only the main connection of a striped session is measured.
+ */
+
+void
+AutoSelectUpdateStart(void)
+{
+  if (!autoSelect || stripeIndex > 0)
+    return;
+  updateStartUs = RFBWaitUs();
+  updateStartBytes = RFBBytesConsumed();
+}
+
+void
+AutoSelectUpdateEnd(void)
+{
+  unsigned long bytes;
+
+  if (!autoSelect || stripeIndex > 0)
+    return;
+
+  bytes = RFBBytesConsumed() - updateStartBytes;
+  if (bytes < AUTO_MIN_UPDATE)
+    return;
+
+  periodBytes += bytes;
+  periodUs += RFBWaitUs() - updateStartUs;
+}
@@ -0,0 +1,123 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * bandwidth.c - keep to a budget on the link from the server.
+ *
+ * With -bandwidth we keep a token bucket, filled at the given rate up to
+ * BUCKET_MS worth of data, from which every byte received is taken.  The
+ * server only sends an update when we ask for one, so when the bucket is
+ * empty we hold back the next request until it has filled up again.  An
+ * update already on its way can overdraw the bucket; the next request then
+ * waits for as long as it takes to pay that back, so over a few seconds we
+ * receive no more than the budget.
+ *
+ * Holding back requests keeps to the budget by lowering the frame rate.
+ * When autoselect.c is choosing the encodings, it also sees the link as no
+ * faster than the budget, so a tight budget gets more compression and
+ * lower JPEG quality as well.
+ *
+ * The bytes of all the connections of a striped session count against the
+ * same budget.
+ */
+
+#include <pthread.h>
+#include <vnc2dl.h>
+
+#define BUCKET_MS 500			/* the most we let build up */
+
+static long bytesPerSec = 0;		/* zero if there is no budget */
+static unsigned long received = 0;	/* by ReadRFBSocket, on any thread */
+
+static pthread_mutex_t bucketMutex = PTHREAD_MUTEX_INITIALIZER;
+static long long tokens;		/* bytes; negative if overdrawn */
+static long lastFill;
+static unsigned long lastReceived;
+
+
+/*
+ * SetBandwidth sets the budget, in kilobits a second.
+ */
+
+void
+SetBandwidth(int kbps)
+{
+  bytesPerSec = kbps * 1000L / 8;
+  tokens = bytesPerSec * BUCKET_MS / 1000;
+  lastFill = CurrentTimeMs();
+  lastReceived = received;
+}
+
+
+/*
+ * BandwidthReceived is told about each read from the server.
+ */
+
+void
+BandwidthReceived(int bytes)
+{
+  if (bytesPerSec)
+    __atomic_add_fetch(&received, bytes, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * BandwidthWaitMs returns how long to wait before asking for another update,
+ * or zero if we can ask now.
+ */
+
+long
+BandwidthWaitMs(void)
+{
+  unsigned long now_received;
+  long now, wait = 0;
+
+  if (!bytesPerSec)
+    return 0;
+
+  pthread_mutex_lock(&bucketMutex);
+
+  now = CurrentTimeMs();
+  now_received = __atomic_load_n(&received, __ATOMIC_RELAXED);
+
+  tokens += (long long)bytesPerSec * (now - lastFill) / 1000;
+  tokens -= now_received - lastReceived;
+  if (tokens > bytesPerSec * BUCKET_MS / 1000)
+    tokens = bytesPerSec * BUCKET_MS / 1000;
+  lastFill = now;
+  lastReceived = now_received;
+
+  if (tokens < 0)
+    wait = -tokens * 1000 / bytesPerSec + 1;
+
+  pthread_mutex_unlock(&bucketMutex);
+  return wait;
+}
+
+
+/*
+ * BandwidthMbps returns the budget in megabits a second, or -1 if there is
+ * none.
+ */
+
+double
+BandwidthMbps(void)
+{
+  return bytesPerSec ? bytesPerSec * 8.0 / 1000000 : -1;
+}
@@ -0,0 +1,333 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * control.c - change settings during a session.
+ *
+ * With -control PATH we listen on a Unix-domain socket at PATH for
+ * commands, one to a line, and answer each with a line starting "ok" or
+ * "error".  The commands are:
+ *
+ *   encodings <list>|auto	as -encodings, or back to the default
+ *   compress <0-9>|default	as -compresslevel
+ *   quality <0-9>|off		as -quality, or no JPEG
+ *   rate <HZ>|off		as -rate, or back to the default
+ *   show			print the current settings
+ *
+ * Encoding changes are sent to the server with SetEncodings, as autoselect.c
+ * does, so they take effect from the next update without reconnecting.
+ * Setting any of them by hand turns automatic selection off; "encodings
+ * auto" turns it back on.
+ *
+ * For example:  echo "quality 3" | socat - UNIX-CONNECT:/tmp/vnc2dl.ctl
+ */
+
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <vnc2dl.h>
+
+#define MAX_CONTROL_CLIENTS 4
+#define CONTROL_LINE_SIZE 256
+
+typedef struct {
+  int fd;				/* -1 if the slot is free */
+  int len;
+  char line[CONTROL_LINE_SIZE];
+} ControlClient;
+
+static int controlSocket = -1;
+static ControlClient clients[MAX_CONTROL_CLIENTS];
+
+
+/*
+ * Reply sends a line back to a client.  The replies are short, so a
+ * failure is left to show up as the client going away.  A client that has
+ * already hung up must not raise SIGPIPE, which would kill us.
+ */
+
+static void
+Reply(ControlClient *c, const char *fmt, ...)
+{
+  char buf[CONTROL_LINE_SIZE];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, sizeof(buf) - 1, fmt, args);
+  va_end(args);
+  if (len < 0)
+    return;
+  if (len > (int)sizeof(buf) - 2)
+    len = sizeof(buf) - 2;
+  buf[len++] = '\n';
+  if (send(c->fd, buf, len, MSG_NOSIGNAL) < 0 && appData.debug)
+    perror("control: send");
+}
+
+
+/*
+ * Send the changed settings to the server, on every connection.
+ */
+
+static Bool
+ResendEncodings(ControlClient *c)
+{
+  if (!SendEncodings()) {
+    Reply(c, "error: cannot send to the server");
+    QuitEventLoop();
+    return False;
+  }
+  StripesResendEncodings();
+  return True;
+}
+
+
+/*
+ * Level parses a level from 0 to 9, or the given word for "none".  Returns
+ * -2 if arg is neither.
+ */
+
+static int
+Level(const char *arg, const char *none)
+{
+  if (strcmp(arg, none) == 0)
+    return -1;
+  if (arg[0] >= '0' && arg[0] <= '9' && arg[1] == '\0')
+    return arg[0] - '0';
+  return -2;
+}
+
+
+/*
+ * Carry out one command.
+ */
+
+static void
+DoCommand(ControlClient *c, char *line)
+{
+  char *cmd, *arg;
+  Bool polling = scheduling;
+  int n;
+
+  cmd = strtok(line, " \t\r");
+  if (!cmd)
+    return;
+  arg = strtok(NULL, "\r");
+  while (arg && (*arg == ' ' || *arg == '\t'))
+    arg++;
+  if (arg && !*arg)
+    arg = NULL;
+
+  if (strcmp(cmd, "show") == 0) {
+    Reply(c, "ok encodings %s compress %d quality %d rate %s",
+	  appData.encodingsString ? appData.encodingsString :
+	  autoSelect ? "auto" : "default",
+	  appData.compressLevel, appData.enableJPEG ? appData.qualityLevel : -1,
+	  scheduling ? "scheduled" : "continuous");
+    return;
+  }
+
+  if (!arg) {
+    Reply(c, "error: usage: encodings|compress|quality|rate <value>, or show");
+    return;
+  }
+
+  if (strcmp(cmd, "encodings") == 0) {
+    if (strcmp(arg, "auto") == 0) {
+      SetEncodingsString(NULL);
+      if (!appData.noAutoSelect)
+	StartAutoSelect();
+    } else {
+      char *p;
+
+      /* Leave room for the pseudo-encodings SendEncodings adds. */
+      for (n = 1, p = arg; (p = strchr(p, ' ')) != NULL; p++)
+	n++;
+      if (n > MAX_ENCODINGS - MAX_PSEUDO_ENCODINGS) {
+	Reply(c, "error: no more than %d encodings",
+	      MAX_ENCODINGS - MAX_PSEUDO_ENCODINGS);
+	return;
+      }
+      SetEncodingsString(arg);
+      autoSelect = False;
+    }
+
+  } else if (strcmp(cmd, "compress") == 0) {
+    if ((n = Level(arg, "default")) == -2) {
+      Reply(c, "error: compress takes 0 to 9, or default");
+      return;
+    }
+    appData.compressLevel = n;
+    autoSelect = False;
+
+  } else if (strcmp(cmd, "quality") == 0) {
+    if ((n = Level(arg, "off")) == -2) {
+      Reply(c, "error: quality takes 0 to 9, or off");
+      return;
+    }
+    appData.enableJPEG = (n >= 0);
+    if (n >= 0)
+      appData.qualityLevel = n;
+    autoSelect = False;
+
+  } else if (strcmp(cmd, "rate") == 0) {
+    /* Scheduled polling replaces the request sent after each update, but
+       can't stop a server which is streaming updates by itself. */
+    if (strcmp(arg, "off") == 0) {
+      if (polling && !StopPollRate()) {
+	Reply(c, "error: cannot send to the server");
+	QuitEventLoop();
+	return;
+      }
+      fprintf(stderr,"Control: no longer polling at a fixed rate\n");
+      Reply(c, "ok");
+      return;
+    }
+    if ((n = atoi(arg)) <= 0) {
+      Reply(c, "error: rate takes a number of updates a second, or off");
+      return;
+    }
+    if (appData.stripes > 1 || continuousUpdates) {
+      Reply(c, "error: rate needs -nocontinuous, and no -stripes");
+      return;
+    }
+    SetPollRate(n);
+    if (!polling)
+      StartSchedule();
+    fprintf(stderr,"Control: polling at %dHz\n", n);
+    Reply(c, "ok");
+    return;
+
+  } else {
+    Reply(c, "error: unknown command '%s'", cmd);
+    return;
+  }
+
+  fprintf(stderr,"Control: %s %s\n", cmd, arg);
+  if (ResendEncodings(c))
+    Reply(c, "ok");
+}
+
+
+/*
+ * A client has sent something, or gone away.
+ */
+
+static void
+ControlClientReady(int fd, void *data)
+{
+  ControlClient *c = data;
+  char *nl;
+  int n;
+
+  n = read(fd, c->line + c->len, CONTROL_LINE_SIZE - 1 - c->len);
+  if (n <= 0) {
+    RemoveEventFd(fd);
+    close(fd);
+    c->fd = -1;
+    return;
+  }
+  c->len += n;
+  c->line[c->len] = '\0';
+
+  while ((nl = strchr(c->line, '\n')) != NULL) {
+    *nl = '\0';
+    DoCommand(c, c->line);
+    c->len -= nl + 1 - c->line;
+    memmove(c->line, nl + 1, c->len + 1);
+  }
+
+  if (c->len == CONTROL_LINE_SIZE - 1) {
+    Reply(c, "error: line too long");
+    c->len = 0;
+  }
+}
+
+
+/*
+ * A new client is connecting.
+ */
+
+static void
+ControlAccept(int fd, void *data)
+{
+  int sock, i;
+
+  sock = AcceptUnixConnection(fd);
+  if (sock < 0)
+    return;
+
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+    if (clients[i].fd < 0)
+      break;
+  }
+  if (i == MAX_CONTROL_CLIENTS || !AddEventFd(sock, ControlClientReady,
+					       &clients[i])) {
+    fprintf(stderr,"%s: too many control connections\n",programName);
+    close(sock);
+    return;
+  }
+  clients[i].fd = sock;
+  clients[i].len = 0;
+}
+
+
+/*
+ * StartControl starts listening for commands at the given path.
+ */
+
+Bool
+StartControl(const char *path)
+{
+  int i;
+
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+    clients[i].fd = -1;
+
+  controlSocket = ListenAtUnixPath(path);
+  if (controlSocket < 0)
+    return False;
+  if (!AddEventFd(controlSocket, ControlAccept, NULL))
+    return False;
+
+  fprintf(stderr,"Listening for commands on %s\n", path);
+  return True;
+}
+
+
+/*
+ * StopControl closes the control socket and removes it.
+ */
+
+void
+StopControl(void)
+{
+  int i;
+
+  if (controlSocket < 0)
+    return;
+
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+    if (clients[i].fd >= 0)
+      close(clients[i].fd);
+  }
+  close(controlSocket);
+  controlSocket = -1;
+  unlink(appData.controlPath);
+}
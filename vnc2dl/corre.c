@@ -28,56 +28,126 @@
 
 #define HandleCoRREBPP CONCAT2E(HandleCoRRE,BPP)
 #define CARDBPP CONCAT2E(CARD,BPP)
+#define GET_PIXEL CONCAT2E(GET_PIXEL,BPP)
+
+/* Size of one subrectangle on the wire: a pixel followed by x, y, w, h. */
+#define SZ_CORRE_SUBRECT (BPP / 8 + 4)
+
+/* Rough costs on the USB link.  The device fills a rectangle with a
+   command for each of its rows, whatever their width, while a bitmap costs
+   about three bytes a pixel (a 16bpp plane and an 8bpp one). */
+#define CORRE_FILL_ROW_BYTES 16
+#define CORRE_PIXEL_BYTES 3
+
+/*
+ * A rectangle with a few large subrectangles is cheapest drawn as fills, but
+ * one with many small ones, such as a line of text, is cheaper to draw into
+ * a bitmap and upload once.  The subrectangles are looked at in the receive
+ * buffer first to see which.
+ */
 
 static Bool
 HandleCoRREBPP (int rx, int ry, int rw, int rh)
 {
-    rfbRREHeader hdr;
-    XGCValues gcv;
-    int i;
-    CARDBPP pix;
+    CARD32 nSubrects;
+    CARDBPP bg, pix;
+    CARDBPP *p;
     CARD8 *ptr;
-    int x, y, w, h;
+    long fillCost;
+    Bool rasterize;
+    int i, n, x, y, w, h;
 
-    if (!ReadFromRFBServer((char *)&hdr, sz_rfbRREHeader))
-	return False;
+    /* Header and background pixel together. */
+    if ((ptr = (CARD8 *)PeekFromRFBServer(sz_rfbRREHeader + BPP / 8)) == NULL)
+        return False;
 
-    hdr.nSubrects = Swap32IfLE(hdr.nSubrects);
+    nSubrects = RD_CARD32(ptr);
+    ptr += sz_rfbRREHeader;
+    GET_PIXEL(bg, ptr);
+    ConsumeFromRFBServer(sz_rfbRREHeader + BPP / 8);
 
-    if (!ReadFromRFBServer((char *)&pix, sizeof(pix)))
-	return False;
+    /* The bitmap is built in buffer, which a CoRRE rectangle (255x255 at
+       most) always fits.  A list too long to look at in one go would cost
+       far more as fills. */
+    if ((long)rw * rh * (BPP / 8) > BUFFER_SIZE) {
+        rasterize = False;
+    } else if (nSubrects > RFB_MAX_PEEK / SZ_CORRE_SUBRECT) {
+        rasterize = True;
+    } else {
+        ptr = NULL;
+        if (nSubrects > 0 &&
+            (ptr = (CARD8 *)PeekFromRFBServer(nSubrects *
+                                              SZ_CORRE_SUBRECT)) == NULL)
+            return False;
 
-#if (BPP == 8)
-    gcv.foreground = (appData.useBGR233 ? BGR233ToPixel[pix] : pix);
-#else
-    gcv.foreground = pix;
-#endif
+        fillCost = (long)CORRE_FILL_ROW_BYTES * rh;
+        for (i = 0; i < nSubrects; i++)
+            fillCost += CORRE_FILL_ROW_BYTES *
+                ptr[i * SZ_CORRE_SUBRECT + BPP / 8 + 3];
+        rasterize = fillCost > (long)CORRE_PIXEL_BYTES * rw * rh;
+    }
 
-    XChangeGC(dpy, gc, GCForeground, &gcv);
-    XFillRectangle(dpy, desktopWin, gc, rx, ry, rw, rh);
+    if (!rasterize) {
+        FillRect(rx, ry, rw, rh, bg);
 
-    if (!ReadFromRFBServer(buffer, hdr.nSubrects * (4 + (BPP / 8))))
-	return False;
+        while (nSubrects > 0) {
+            n = RFB_MAX_PEEK / SZ_CORRE_SUBRECT;
+            if (n > nSubrects)
+                n = nSubrects;
 
-    ptr = (CARD8 *)buffer;
+            if ((ptr = (CARD8 *)PeekFromRFBServer(n * SZ_CORRE_SUBRECT)) == NULL)
+                return False;
 
-    for (i = 0; i < hdr.nSubrects; i++) {
-	pix = *(CARDBPP *)ptr;
-	ptr += BPP/8;
-	x = *ptr++;
-	y = *ptr++;
-	w = *ptr++;
-	h = *ptr++;
+            for (i = 0; i < n; i++) {
+                GET_PIXEL(pix, ptr);
+                FillRect(rx + ptr[0], ry + ptr[1], ptr[2], ptr[3], pix);
+                ptr += 4;
+            }
 
-#if (BPP == 8)
-	gcv.foreground = (appData.useBGR233 ? BGR233ToPixel[pix] : pix);
-#else
-	gcv.foreground = pix;
-#endif
+            ConsumeFromRFBServer(n * SZ_CORRE_SUBRECT);
+            nSubrects -= n;
+        }
+        return True;
+    }
 
-	XChangeGC(dpy, gc, GCForeground, &gcv);
-	XFillRectangle(dpy, desktopWin, gc, rx + x, ry + y, w, h);
+    p = (CARDBPP *)buffer;
+    for (i = 0; i < rw * rh; i++)
+        p[i] = bg;
+
+    while (nSubrects > 0) {
+        n = RFB_MAX_PEEK / SZ_CORRE_SUBRECT;
+        if (n > nSubrects)
+            n = nSubrects;
+
+        if ((ptr = (CARD8 *)PeekFromRFBServer(n * SZ_CORRE_SUBRECT)) == NULL)
+            return False;
+
+        for (i = 0; i < n; i++) {
+            GET_PIXEL(pix, ptr);
+            x = *ptr++;
+            y = *ptr++;
+            w = *ptr++;
+            h = *ptr++;
+
+            /* Keep a bad subrectangle inside the bitmap. */
+            if (x + w > rw)
+                w = rw - x;
+            if (y + h > rh)
+                h = rh - y;
+            for (p = (CARDBPP *)buffer + y * rw + x; h > 0; h--, p += rw)
+                for (x = 0; x < w; x++)
+                    p[x] = pix;
+        }
+
+        ConsumeFromRFBServer(n * SZ_CORRE_SUBRECT);
+        nSubrects -= n;
     }
 
+    CopyDataToScreen(buffer, rx, ry, rw, rh);
     return True;
 }
+
+#undef GET_PIXEL
+#undef SZ_CORRE_SUBRECT
+#undef CORRE_FILL_ROW_BYTES
+#undef CORRE_PIXEL_BYTES
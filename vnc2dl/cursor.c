@@ -0,0 +1,227 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * cursor.c - draw the server's cursor ourselves.
+ *
+ * With the XCursor and RichCursor pseudo-encodings the server sends us the
+ * shape of its cursor, and with PointerPos where it is, instead of drawing
+ * the cursor into the framebuffer.  A moving pointer then costs a few bytes
+ * rather than fresh pixels for everywhere it has been.
+ *
+ * Before the cursor is drawn, what is under it is copied into a save-under
+ * area in device memory (see dldevice.c), so taking it off the screen again
+ * is a copy within the device.  Only the cursor's own pixels go over USB, as
+ * a bitmap for each run of opaque pixels in a row.
+ *
+ * A framebuffer update calls SoftCursorLockArea() before it draws anything,
+ * which takes the cursor off the screen if it is in the way, and
+ * SoftCursorUnlockScreen() when it has finished, which puts it back.
+ */
+
+#include <vnc2dl.h>
+
+static Bool cursorShown = False;	/* drawn on the device */
+static int cursorX = 0, cursorY = 0;	/* the pointer */
+static int hotX, hotY;
+static int cursorWidth = 0, cursorHeight = 0;	/* zero if no cursor */
+static uint32_t *cursorPixels = NULL;
+static CARD8 *cursorMask = NULL;	/* one bit a pixel, rows byte-aligned */
+
+
+/*
+ * Draw the cursor on the device, saving what is under it first.
+ */
+
+static void
+ShowCursor(void)
+{
+  int x = cursorX - hotX, y = cursorY - hotY;
+  int bytesPerRow = (cursorWidth + 7) / 8;
+  CARD8 *mask;
+  int row, start, i;
+
+  if (cursorShown || cursorWidth == 0)
+    return;
+
+  SaveUnder(x, y, cursorWidth, cursorHeight);
+
+  for (row = 0; row < cursorHeight; row++) {
+    mask = cursorMask + row * bytesPerRow;
+    i = 0;
+    while (i < cursorWidth) {
+      while (i < cursorWidth && !(mask[i / 8] & (0x80 >> (i % 8))))
+	i++;
+      start = i;
+      while (i < cursorWidth && (mask[i / 8] & (0x80 >> (i % 8))))
+	i++;
+      if (i > start)
+	CopyDataToScreen((char *)&cursorPixels[row * cursorWidth + start],
+			 x + start, y + row, i - start, 1);
+    }
+  }
+
+  cursorShown = True;
+}
+
+
+/*
+ * Take the cursor off the device, putting back what was under it.
+ */
+
+static void
+HideCursor(void)
+{
+  if (!cursorShown)
+    return;
+
+  RestoreUnder(cursorX - hotX, cursorY - hotY, cursorWidth, cursorHeight);
+  cursorShown = False;
+}
+
+
+/*
+ * Convert an XCursor colour to our pixel format.
+ */
+
+static uint32_t
+CursorColour(CARD8 r, CARD8 g, CARD8 b)
+{
+  return (uint32_t)(r * myFormat.redMax / 255) << myFormat.redShift |
+    (uint32_t)(g * myFormat.greenMax / 255) << myFormat.greenShift |
+    (uint32_t)(b * myFormat.blueMax / 255) << myFormat.blueShift;
+}
+
+
+/*
+ * HandleCursorShape reads a new cursor shape sent with the XCursor or
+ * RichCursor pseudo-encoding.  The hotspot is at (xhot, yhot); a zero size
+ * means the server wants no cursor shown.  The new cursor appears when the
+ * update is finished.
+ */
+
+Bool
+HandleCursorShape(int xhot, int yhot, int width, int height, CARD32 enc)
+{
+  int bytesPerRow = (width + 7) / 8;
+  int maskBytes = bytesPerRow * height;
+  rfbXCursorColors colours;
+  uint32_t fg, bg;
+  int row, col;
+
+  HideCursor();
+  cursorWidth = cursorHeight = 0;
+
+  if (width * height == 0)
+    return True;
+
+  cursorPixels = realloc(cursorPixels, width * height * sizeof(uint32_t));
+  cursorMask = realloc(cursorMask, maskBytes);
+  if (!cursorPixels || !cursorMask) {
+    fprintf(stderr,"%s: cannot allocate cursor\n",programName);
+    return False;
+  }
+
+  if (enc == rfbEncodingXCursor) {
+    if (!ReadFromRFBServer((char *)&colours, sz_rfbXCursorColors))
+      return False;
+    fg = CursorColour(colours.foreRed, colours.foreGreen, colours.foreBlue);
+    bg = CursorColour(colours.backRed, colours.backGreen, colours.backBlue);
+
+    /* The source bitmap is the same size as the mask, so read it into the
+       mask buffer and expand it from there. */
+    if (!ReadFromRFBServer((char *)cursorMask, maskBytes))
+      return False;
+    for (row = 0; row < height; row++) {
+      for (col = 0; col < width; col++) {
+	cursorPixels[row * width + col] =
+	  (cursorMask[row * bytesPerRow + col / 8] & (0x80 >> (col % 8))) ?
+	  fg : bg;
+      }
+    }
+  } else {
+    /* RichCursor pixels are in our format, which is 32bpp. */
+    if (!ReadFromRFBServer((char *)cursorPixels, width * height * 4))
+      return False;
+  }
+
+  if (!ReadFromRFBServer((char *)cursorMask, maskBytes))
+    return False;
+
+  /* The save-under has a fixed size. */
+  if (width > CURSOR_MAX_SIZE || height > CURSOR_MAX_SIZE) {
+    fprintf(stderr,"Cursor too large (%dx%d): not shown\n", width, height);
+    return True;
+  }
+
+  hotX = xhot;
+  hotY = yhot;
+  cursorWidth = width;
+  cursorHeight = height;
+  return True;
+}
+
+
+/*
+ * SoftCursorMove moves the cursor to follow the server's pointer.  If the
+ * cursor is off the screen for an update, it moves when it comes back.
+ */
+
+void
+SoftCursorMove(int x, int y)
+{
+  Bool shown = cursorShown;
+
+  if (x == cursorX && y == cursorY)
+    return;
+
+  HideCursor();
+  cursorX = x;
+  cursorY = y;
+  if (shown)
+    ShowCursor();
+}
+
+
+/*
+ * SoftCursorLockArea is called before drawing in the given area of the
+ * framebuffer, and takes the cursor off the screen if it is in the way.
+ */
+
+void
+SoftCursorLockArea(int x, int y, int w, int h)
+{
+  int cx = cursorX - hotX, cy = cursorY - hotY;
+
+  if (cursorShown &&
+      x < cx + cursorWidth && cx < x + w &&
+      y < cy + cursorHeight && cy < y + h)
+    HideCursor();
+}
+
+
+/*
+ * SoftCursorUnlockScreen puts the cursor back once drawing is done.
+ */
+
+void
+SoftCursorUnlockScreen(void)
+{
+  ShowCursor();
+}
@@ -20,10 +20,133 @@
 
 #include "vnc2dl.h"
 #include <stdio.h> 
+#include <pthread.h>
+#include <time.h>
 #include "libdlo.h" 
 
 dlo_dev_t dl_uid; 
 
+/*
+ * The viewport.  When the server's desktop is bigger than the device's mode,
+ * the device shows the part of it at (viewportX, viewportY).  Decoders draw
+ * in server coordinates; the output functions below clip to the viewport and
+ * translate.  Until InitViewport() is called the viewport is the device's
+ * screen at the origin.
+ */
+
+int deviceWidth, deviceHeight;
+int viewportX = 0, viewportY = 0;
+int viewportWidth, viewportHeight;
+
+/*
+ * The mode we normally use.  A desktop smaller than this is shown in a mode
+ * of its own size, if the device has one (see SelectDeviceMode).
+ */
+
+#define DEVICE_MODE_WIDTH 1280
+#define DEVICE_MODE_HEIGHT 1024
+
+static dlo_col32_t background;
+
+/*
+ * The cursor save-under (see cursor.c) is a view in device memory just past
+ * the screen, so that taking the cursor off the screen, and putting back
+ * what was under it, are copies within the device.
+ */
+
+static dlo_view_t saveUnderView;
+
+/*
+ * Pipeline mode (-pipeline).
+ *
+ * The thread which reads and decodes RFB data hands device operations to a
+ * second thread through a bounded single-producer, single-consumer queue,
+ * so that network input and USB output overlap.  Pixel data for bitmap
+ * commands is copied into an arena which is allocated in the same FIFO
+ * order as the queue, so it can be reclaimed simply by advancing a counter.
+ *
+ * The queue and arena indices are free-running counters, each written by
+ * one thread only and published with release/acquire atomics.  The mutex
+ * and condition variables are used only to sleep when the queue is empty
+ * (device thread) or full (decoding thread).
+ */
+
+#define DEVICE_QUEUE_LEN 256                /* must be a power of two */
+#define DEVICE_ARENA_SIZE (16*1024*1024)
+
+typedef enum {
+    DeviceCmdBitmap,
+    DeviceCmdFill,
+    DeviceCmdCopy,
+    DeviceCmdQuit
+} DeviceCmdType;
+
+typedef struct {
+    DeviceCmdType type;
+    int x, y, w, h;
+    int src_x, src_y;                       /* DeviceCmdCopy */
+    dlo_view_t *srcView, *destView;         /* DeviceCmdCopy; NULL: screen */
+    CARD32 colour;                          /* DeviceCmdFill */
+    char *pixels;                           /* DeviceCmdBitmap */
+    unsigned long arenaBytes;               /* arena space to release */
+} DeviceCmd;
+
+static Bool pipelineActive = False;
+static pthread_t deviceThread;
+static pthread_mutex_t deviceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deviceWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t deviceSpace = PTHREAD_COND_INITIALIZER;
+
+static DeviceCmd deviceQueue[DEVICE_QUEUE_LEN];
+static unsigned long qHead = 0, qTail = 0;
+static char *deviceArena;
+static unsigned long arenaHead = 0, arenaTail = 0;
+
+/*
+ * With -stripes, several threads decode into the device at once (see
+ * stripes.c).  The output entry points then take outputMutex, which makes
+ * the queue above safe for more than one producer and keeps libdlo to one
+ * thread at a time otherwise.  The main thread also holds it while it moves
+ * the viewport, so that nothing is drawn through a viewport half changed.
+ * It is recursive because those callers use the entry points themselves.
+ */
+
+static Bool deviceShared = False;
+static pthread_mutex_t outputMutex;
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+/*
+ * Device upload rate, for pacing update requests (see DeviceDrainMs).
+ * Bitmap uploads are timed, and bmpNsPerKPixel is a moving average of the
+ * cost per 1024 pixels, written only by whichever thread drives libdlo.
+ * Small bitmaps are dominated by per-call overhead and would make large
+ * ones look cheaper than they are, so they aren't counted.  Fills and
+ * copies are cheap on the USB link and are ignored.
+ *
+ * pixelsQueued and pixelsDone count bitmap pixels handed to the device
+ * thread and pixels it has finished with; the difference is its backlog.
+ */
+
+#define RATE_MIN_PIXELS 4096
+
+static unsigned long bmpNsPerKPixel = 0;
+static unsigned long pixelsQueued = 0, pixelsDone = 0;
+
+static void DoCopyDataToScreen(char *buf, int x, int y, int width, int height,
+                               int stride);
+static void DoFillRect(int x, int y, int width, int height, CARD32 colour);
+static void DoCopyRect(dlo_view_t *srcView, int src_x, int src_y,
+                       int width, int height,
+                       dlo_view_t *destView, int dest_x, int dest_y);
+static void DeviceFillRect(int x, int y, int width, int height,
+                           CARD32 colour);
+static void DeviceCopyRect(dlo_view_t *srcView, int src_x, int src_y,
+                           int width, int height,
+                           dlo_view_t *destView, int dest_x, int dest_y);
+static void SetSaveUnderView(dlo_mode_t *info);
+
 Bool InitialiseDevice() {
     dlo_init_t    ini_flags = { 0 };
     dlo_claim_t   cnf_flags = { 0 }; 
@@ -38,8 +161,8 @@ Bool InitialiseDevice() {
 
     /* Select a mode */ 
     desc.view.base    = 0;     /* Base address in device memory for this screen display */ 
-    desc.view.width   = 1280; 
-    desc.view.height  = 1024;  /* We can use zero as a wildcard here */ 
+    desc.view.width   = DEVICE_MODE_WIDTH; 
+    desc.view.height  = DEVICE_MODE_HEIGHT;  /* We can use zero as a wildcard here */ 
     desc.view.bpp     = 24;    /* Can be a wildcard, meaning we don't mind what colour depth */ 
     desc.refresh      = 0;     /* Refresh rate in Hz. Can be a wildcard; any refresh rate */ 
     ERR(dlo_set_mode(dl_uid, &desc)); 
@@ -54,10 +177,14 @@ Bool InitialiseDevice() {
         info->view.bpp, 
         (int)info->view.base); 
 
+    deviceWidth = viewportWidth = info->view.width;
+    deviceHeight = viewportHeight = info->view.height;
+    SetSaveUnderView(info);
 
     /* Clear the screen */ 
     srandom(time(NULL));
-    ERR(dlo_fill_rect(dl_uid, NULL, NULL, DLO_RGB(random() & 0xff, random() & 0xff, random() & 0xff))); 
+    background = DLO_RGB(random() & 0xff, random() & 0xff, random() & 0xff);
+    ERR(dlo_fill_rect(dl_uid, NULL, NULL, background)); 
     
     // We want the VNC server to use the device's pixel format
     myFormat.bitsPerPixel = 32;
@@ -84,13 +211,16 @@ Bool InitialiseDevice() {
  * CopyDataToScreen.
  */
 
-void
-CopyDataToScreen(char *buf, int x, int y, int width, int height)
+static void
+DoCopyDataToScreen(char *buf, int x, int y, int width, int height, int stride)
 {
     dlo_fbuf_t    fbuf;
     dlo_retcode_t err; 
     dlo_dot_t     dot;
     dlo_bmpflags_t bflags = {0};
+    struct timespec start, end;
+    double ns;
+    unsigned long cost;
     
     // if (appData.rawDelay != 0) {
     //     // XXX Draw a coloured rectangle and then...
@@ -113,13 +243,24 @@ CopyDataToScreen(char *buf, int x, int y, int width, int height)
     fbuf.width = width;
     fbuf.height = height;
     fbuf.base = buf;
-    fbuf.stride = width;
+    fbuf.stride = stride;
     fbuf.fmt = dlo_pixfmt_abgr8888;
     // r.origin = dot;
     // r.width = width;
     // r.height = height;
     // ERR(dlo_fill_rect(dl_uid, NULL, &r, DLO_RGB(random() & 0xff, random() & 0xff, random() & 0xff))); 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     ERR_GOTO(dlo_copy_host_bmp(dl_uid, bflags, &fbuf, NULL, &dot));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (width * height >= RATE_MIN_PIXELS) {
+        ns = (end.tv_sec - start.tv_sec) * 1000000000.0 +
+            (end.tv_nsec - start.tv_nsec);
+        ns = ns * 1024 / (width * height);
+        cost = LOAD(bmpNsPerKPixel);
+        STORE(bmpNsPerKPixel,
+              cost ? (cost * 7 + (unsigned long)ns) / 8 : (unsigned long)ns);
+    }
     return;
     
     error:
@@ -127,8 +268,28 @@ CopyDataToScreen(char *buf, int x, int y, int width, int height)
         printf("dlo_copy_host_bmp error %u '%s'\n", (int)err, dlo_strerror(err));
 }
 
-void
-CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y)
+static void
+DoFillRect(int x, int y, int width, int height, CARD32 colour)
+{
+    dlo_rect_t r;
+    dlo_retcode_t err; 
+
+    r.origin.x = x;
+    r.origin.y = y;
+    r.width = width;
+    r.height = height;
+
+    ERR_GOTO(dlo_fill_rect(dl_uid, NULL, &r, colour));
+    return;
+
+    error:
+    // Not much we can do here
+        printf("dlo_fill_rect error %u '%s'\n", (int)err, dlo_strerror(err));
+}
+
+static void
+DoCopyRect(dlo_view_t *srcView, int src_x, int src_y, int width, int height,
+           dlo_view_t *destView, int dest_x, int dest_y)
 {
     dlo_rect_t r;
     dlo_dot_t  dest; 
@@ -140,7 +301,7 @@ CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y)
     dest.x = dest_x;
     dest.y = dest_y;
     
-    ERR_GOTO(dlo_copy_rect(dl_uid, NULL, &r, NULL, &dest));
+    ERR_GOTO(dlo_copy_rect(dl_uid, srcView, &r, destView, &dest));
     return;
     
     error:
@@ -148,10 +309,586 @@ CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y)
         printf("dlo_copy_rect error %u '%s'\n", (int)err, dlo_strerror(err));
 }
     
+
+/*
+ * The device thread: execute queued commands in order until told to quit.
+ */
+
+static void *
+DeviceThread(void *arg)
+{
+    DeviceCmd *cmd;
+    DeviceCmdType type;
+
+    do {
+        if (qHead == LOAD(qTail)) {
+            pthread_mutex_lock(&deviceMutex);
+            while (qHead == LOAD(qTail))
+                pthread_cond_wait(&deviceWork, &deviceMutex);
+            pthread_mutex_unlock(&deviceMutex);
+        }
+
+        cmd = &deviceQueue[qHead & (DEVICE_QUEUE_LEN - 1)];
+        type = cmd->type;
+
+        switch (type) {
+        case DeviceCmdBitmap:
+            DoCopyDataToScreen(cmd->pixels, cmd->x, cmd->y, cmd->w, cmd->h,
+                               cmd->w);
+            STORE(pixelsDone, pixelsDone + (unsigned long)cmd->w * cmd->h);
+            break;
+        case DeviceCmdFill:
+            DoFillRect(cmd->x, cmd->y, cmd->w, cmd->h, cmd->colour);
+            break;
+        case DeviceCmdCopy:
+            DoCopyRect(cmd->srcView, cmd->src_x, cmd->src_y, cmd->w, cmd->h,
+                       cmd->destView, cmd->x, cmd->y);
+            break;
+        case DeviceCmdQuit:
+            break;
+        }
+
+        STORE(arenaHead, arenaHead + cmd->arenaBytes);
+        STORE(qHead, qHead + 1);
+
+        pthread_mutex_lock(&deviceMutex);
+        pthread_cond_signal(&deviceSpace);
+        pthread_mutex_unlock(&deviceMutex);
+    } while (type != DeviceCmdQuit);
+
+    return NULL;
+}
+
+
+/*
+ * StartDeviceThread switches device output into pipeline mode.
+ */
+
+Bool
+StartDeviceThread(void)
+{
+    deviceArena = malloc(DEVICE_ARENA_SIZE);
+    if (!deviceArena) {
+        fprintf(stderr, "%s: cannot allocate device arena\n", programName);
+        return False;
+    }
+
+    if (pthread_create(&deviceThread, NULL, DeviceThread, NULL) != 0) {
+        fprintf(stderr, "%s: cannot start device thread\n", programName);
+        free(deviceArena);
+        return False;
+    }
+
+    pipelineActive = True;
+    return True;
+}
+
+
+/*
+ * Reserve a queue slot and, for bitmaps, nbytes of arena space, sleeping
+ * until the device thread has made room.  The command is not visible to the
+ * device thread until CommitDeviceCmd().
+ */
+
+static DeviceCmd *
+BeginDeviceCmd(DeviceCmdType type, unsigned long nbytes)
+{
+    DeviceCmd *cmd;
+    unsigned long start = arenaTail;
+    unsigned long off;
+
+    if (nbytes) {
+        /* Bitmaps must be contiguous, so skip the end of the arena if the
+           request doesn't fit there.  Keep allocations 16-byte aligned. */
+        nbytes = (nbytes + 15) & ~15UL;
+        off = start % DEVICE_ARENA_SIZE;
+        if (off + nbytes > DEVICE_ARENA_SIZE)
+            start += DEVICE_ARENA_SIZE - off;
+    }
+
+    if (qTail - LOAD(qHead) == DEVICE_QUEUE_LEN ||
+        start + nbytes - LOAD(arenaHead) > DEVICE_ARENA_SIZE) {
+        pthread_mutex_lock(&deviceMutex);
+        while (qTail - LOAD(qHead) == DEVICE_QUEUE_LEN ||
+               start + nbytes - LOAD(arenaHead) > DEVICE_ARENA_SIZE)
+            pthread_cond_wait(&deviceSpace, &deviceMutex);
+        pthread_mutex_unlock(&deviceMutex);
+    }
+
+    cmd = &deviceQueue[qTail & (DEVICE_QUEUE_LEN - 1)];
+    cmd->type = type;
+    cmd->pixels = nbytes ? deviceArena + start % DEVICE_ARENA_SIZE : NULL;
+    cmd->arenaBytes = start + nbytes - arenaTail;
+    arenaTail = start + nbytes;
+    return cmd;
+}
+
+static void
+CommitDeviceCmd(void)
+{
+    STORE(qTail, qTail + 1);
+
+    pthread_mutex_lock(&deviceMutex);
+    pthread_cond_signal(&deviceWork);
+    pthread_mutex_unlock(&deviceMutex);
+}
+
+
+/*
+ * FlushDevice waits until every queued command has been sent to the device.
+ * It returns at once when not in pipeline mode.
+ */
+
+void
+FlushDevice(void)
+{
+    if (!pipelineActive || LOAD(qHead) == qTail)
+        return;
+
+    pthread_mutex_lock(&deviceMutex);
+    while (LOAD(qHead) != qTail)
+        pthread_cond_wait(&deviceSpace, &deviceMutex);
+    pthread_mutex_unlock(&deviceMutex);
+}
+
+
+/*
+ * DeviceDrainMs estimates how long the device thread will take to get
+ * through the bitmaps queued for it, from the measured upload rate.  Output
+ * is synchronous when not in pipeline mode, so there is never a backlog.
+ */
+
+long
+DeviceDrainMs(void)
+{
+    unsigned long backlog;
+
+    if (!pipelineActive)
+        return 0;
+
+    backlog = pixelsQueued - LOAD(pixelsDone);
+    return (long)((double)backlog * LOAD(bmpNsPerKPixel) / 1024 / 1000000);
+}
+
+
+/*
+ * InitViewport sizes the viewport for a server desktop of the given size and
+ * places it as near (x, y) as it will go.
+ */
+
+void
+InitViewport(int fbWidth, int fbHeight, int x, int y)
+{
+    viewportWidth = fbWidth < deviceWidth ? fbWidth : deviceWidth;
+    viewportHeight = fbHeight < deviceHeight ? fbHeight : deviceHeight;
+    viewportX = x < 0 ? 0 : x;
+    viewportY = y < 0 ? 0 : y;
+    if (viewportX > fbWidth - viewportWidth)
+        viewportX = fbWidth - viewportWidth;
+    if (viewportY > fbHeight - viewportHeight)
+        viewportY = fbHeight - viewportHeight;
+
+    if (viewportWidth < fbWidth || viewportHeight < fbHeight)
+        fprintf(stderr, "Showing %dx%d of the %dx%d desktop, from (%d, %d)\n",
+                viewportWidth, viewportHeight, fbWidth, fbHeight,
+                viewportX, viewportY);
+}
+
+
+/*
+ * ClipToViewport reduces a rectangle in server coordinates to the part
+ * inside the viewport.  Returns False if none of it is.
+ */
+
+Bool
+ClipToViewport(int *x, int *y, int *width, int *height)
+{
+    int x2 = *x + *width, y2 = *y + *height;
+
+    if (*x < viewportX)
+        *x = viewportX;
+    if (*y < viewportY)
+        *y = viewportY;
+    if (x2 > viewportX + viewportWidth)
+        x2 = viewportX + viewportWidth;
+    if (y2 > viewportY + viewportHeight)
+        y2 = viewportY + viewportHeight;
+
+    *width = x2 - *x;
+    *height = y2 - *y;
+    return *width > 0 && *height > 0;
+}
+
+
+/*
+ * MoveViewport moves the viewport to (x, y), which the caller has checked.
+ * Whatever is still in view is moved across on the device; the caller must
+ * get the newly exposed areas redrawn.
+ */
+
+void
+MoveViewport(int x, int y)
+{
+    int dx = x - viewportX, dy = y - viewportY;
+    int w = viewportWidth - (dx < 0 ? -dx : dx);
+    int h = viewportHeight - (dy < 0 ? -dy : dy);
+    int keepX = dx > 0 ? x : viewportX;     /* in view before and after */
+    int keepY = dy > 0 ? y : viewportY;
+
+    /* CopyRect maps through the old viewport, so shift the destination
+       back by the distance moved. */
+    if (w > 0 && h > 0)
+        CopyRect(keepX, keepY, w, h, keepX - dx, keepY - dy);
+
+    viewportX = x;
+    viewportY = y;
+}
+
+
+/*
+ * SelectDeviceMode puts the device in the mode that best suits a server
+ * desktop of the given size: the desktop's own size if that is smaller than
+ * our usual mode and the device can do it, and otherwise the usual mode.
+ * Returns True if the mode changed, in which case the screen has been
+ * cleared and the caller must call InitViewport().
+ */
+
+Bool
+SelectDeviceMode(int fbWidth, int fbHeight)
+{
+    dlo_mode_t desc;
+    dlo_mode_t *info;
+    dlo_retcode_t err;
+
+    desc.view.base = 0;
+    desc.view.width = fbWidth < DEVICE_MODE_WIDTH ? fbWidth : DEVICE_MODE_WIDTH;
+    desc.view.height = fbHeight < DEVICE_MODE_HEIGHT ?
+        fbHeight : DEVICE_MODE_HEIGHT;
+    desc.view.bpp = 24;
+    desc.refresh = 0;
+
+    if (desc.view.width == deviceWidth && desc.view.height == deviceHeight)
+        return False;
+
+    /* libdlo must not be called from two threads at once. */
+    FlushDevice();
+
+    if (dlo_set_mode(dl_uid, &desc) != dlo_ok) {
+        if (deviceWidth == DEVICE_MODE_WIDTH &&
+            deviceHeight == DEVICE_MODE_HEIGHT)
+            return False;
+        desc.view.width = DEVICE_MODE_WIDTH;
+        desc.view.height = DEVICE_MODE_HEIGHT;
+        ERR_GOTO(dlo_set_mode(dl_uid, &desc));
+    }
+
+    info = dlo_get_mode(dl_uid);
+    if (!info) {
+        fprintf(stderr, "%s: cannot read device mode\n", programName);
+        return True;
+    }
+    printf("DL device mode %ux%u @ %u Hz %u bpp base &%X\n",
+        info->view.width,
+        info->view.height,
+        info->refresh,
+        info->view.bpp,
+        (int)info->view.base);
+
+    deviceWidth = viewportWidth = info->view.width;
+    deviceHeight = viewportHeight = info->view.height;
+    viewportX = viewportY = 0;
+    SetSaveUnderView(info);
+
+    ERR_GOTO(dlo_fill_rect(dl_uid, NULL, NULL, background));
+    return True;
+
+  error:
+    printf("dlo_set_mode error %u '%s'\n", (int)err, dlo_strerror(err));
+    return True;
+}
+
+
+/*
+ * ResizeViewport fits the viewport to a server desktop which has changed
+ * size, without changing the device mode.  It keeps its position if it can;
+ * what stays in view is left, or moved across, on the device.  Any part of
+ * the device the viewport no longer covers is cleared.  The caller must get
+ * the newly exposed areas redrawn.
+ */
+
+void
+ResizeViewport(int fbWidth, int fbHeight)
+{
+    int w = fbWidth < deviceWidth ? fbWidth : deviceWidth;
+    int h = fbHeight < deviceHeight ? fbHeight : deviceHeight;
+    int x = viewportX, y = viewportY;
+
+    if (x > fbWidth - w)
+        x = fbWidth - w;
+    if (y > fbHeight - h)
+        y = fbHeight - h;
+    if (x != viewportX || y != viewportY)
+        MoveViewport(x, y);
+
+    if (w < viewportWidth)
+        DeviceFillRect(w, 0, viewportWidth - w, viewportHeight, background);
+    if (h < viewportHeight)
+        DeviceFillRect(0, h, w, viewportHeight - h, background);
+
+    viewportWidth = w;
+    viewportHeight = h;
+}
+
+
+/*
+ * SetSaveUnderView places the cursor save-under after the screen of the
+ * given mode.  The device keeps 24bpp screens as a 16bpp plane followed by
+ * an 8bpp one, so a screen takes three bytes per pixel.
+ */
+
+static void
+SetSaveUnderView(dlo_mode_t *info)
+{
+    saveUnderView.width = CURSOR_MAX_SIZE;
+    saveUnderView.height = CURSOR_MAX_SIZE;
+    saveUnderView.bpp = info->view.bpp;
+    saveUnderView.base = info->view.base +
+        info->view.width * info->view.height * 3;
+}
+
+
+/*
+ * SaveUnder copies the screen under a cursor-sized rectangle, in server
+ * coordinates, into the save-under, and RestoreUnder puts it back.  Only
+ * the part in the viewport is kept, so the viewport must not move between
+ * the two.
+ */
+
+void
+SaveUnder(int x, int y, int width, int height)
+{
+    int cx = x, cy = y;
+
+    if (!ClipToViewport(&cx, &cy, &width, &height))
+        return;
+    DeviceCopyRect(NULL, cx - viewportX, cy - viewportY, width, height,
+                   &saveUnderView, cx - x, cy - y);
+}
+
+void
+RestoreUnder(int x, int y, int width, int height)
+{
+    int cx = x, cy = y;
+
+    if (!ClipToViewport(&cx, &cy, &width, &height))
+        return;
+    DeviceCopyRect(&saveUnderView, cx - x, cy - y, width, height,
+                   NULL, cx - viewportX, cy - viewportY);
+}
+
+
+/*
+ * ShareDevice is called before any other thread starts drawing.
+ */
+
+void
+ShareDevice(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&outputMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    deviceShared = True;
+}
+
+void
+LockDevice(void)
+{
+    if (deviceShared)
+        pthread_mutex_lock(&outputMutex);
+}
+
+void
+UnlockDevice(void)
+{
+    if (deviceShared)
+        pthread_mutex_unlock(&outputMutex);
+}
+
+
+/*
+ * Device output entry points used by the decoders.  Coordinates are the
+ * server's.  In pipeline mode these only queue the operation; otherwise they
+ * drive libdlo directly.
+ */
+
+/* CopyStridedDataToScreen, with the device locked. */
+
+static void
+CopyDataToScreenLocked(char *buf, int stride, int x, int y, int width,
+                       int height)
+{
+    DeviceCmd *cmd;
+    int bpp = myFormat.bitsPerPixel / 8;
+    int cx = x, cy = y, cw = width, ch = height;
+    unsigned long nbytes;
+    char *out;
+    int row;
+
+    if (!ClipToViewport(&cx, &cy, &cw, &ch))
+        return;
+    buf += ((cy - y) * stride + (cx - x)) * bpp;
+    cx -= viewportX;
+    cy -= viewportY;
+
+    if (!pipelineActive) {
+        DoCopyDataToScreen(buf, cx, cy, cw, ch, stride);
+        return;
+    }
+
+    nbytes = (unsigned long)cw * ch * bpp;
+    if (nbytes > DEVICE_ARENA_SIZE / 2) {
+        /* Too big to stage; do it in line, after what's already queued. */
+        FlushDevice();
+        DoCopyDataToScreen(buf, cx, cy, cw, ch, stride);
+        return;
+    }
+
+    cmd = BeginDeviceCmd(DeviceCmdBitmap, nbytes);
+    if (cw == stride) {
+        memcpy(cmd->pixels, buf, nbytes);
+    } else {
+        out = cmd->pixels;
+        for (row = 0; row < ch; row++) {
+            memcpy(out, buf, cw * bpp);
+            out += cw * bpp;
+            buf += stride * bpp;
+        }
+    }
+    cmd->x = cx;
+    cmd->y = cy;
+    cmd->w = cw;
+    cmd->h = ch;
+    pixelsQueued += (unsigned long)cw * ch;
+    CommitDeviceCmd();
+}
+
+void
+CopyDataToScreen(char *buf, int x, int y, int width, int height)
+{
+    LockDevice();
+    CopyDataToScreenLocked(buf, width, x, y, width, height);
+    UnlockDevice();
+}
+
+/* The same from part of a wider buffer, whose rows are stride pixels
+   apart. */
+
+void
+CopyStridedDataToScreen(char *buf, int stride, int x, int y, int width,
+                        int height)
+{
+    LockDevice();
+    CopyDataToScreenLocked(buf, stride, x, y, width, height);
+    UnlockDevice();
+}
+
+void
+FillRect(int x, int y, int width, int height, CARD32 colour)
+{
+    LockDevice();
+    if (ClipToViewport(&x, &y, &width, &height))
+        DeviceFillRect(x - viewportX, y - viewportY, width, height, colour);
+    UnlockDevice();
+}
+
+/* The same in device coordinates. */
+
+static void
+DeviceFillRect(int x, int y, int width, int height, CARD32 colour)
+{
+    DeviceCmd *cmd;
+
+    if (!pipelineActive) {
+        DoFillRect(x, y, width, height, colour);
+        return;
+    }
+
+    cmd = BeginDeviceCmd(DeviceCmdFill, 0);
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = width;
+    cmd->h = height;
+    cmd->colour = colour;
+    CommitDeviceCmd();
+}
+
+void
+CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y)
+{
+    int x = dest_x, y = dest_y;
+
+    /* The caller makes sure that the source is in view. */
+    LockDevice();
+    if (ClipToViewport(&dest_x, &dest_y, &width, &height)) {
+        src_x += dest_x - x - viewportX;
+        src_y += dest_y - y - viewportY;
+        DeviceCopyRect(NULL, src_x, src_y, width, height,
+                       NULL, dest_x - viewportX, dest_y - viewportY);
+    }
+    UnlockDevice();
+}
+
+/* The same in device coordinates, between views. */
+
+static void
+DeviceCopyRect(dlo_view_t *srcView, int src_x, int src_y, int width,
+               int height, dlo_view_t *destView, int dest_x, int dest_y)
+{
+    DeviceCmd *cmd;
+
+    if (!pipelineActive) {
+        DoCopyRect(srcView, src_x, src_y, width, height,
+                   destView, dest_x, dest_y);
+        return;
+    }
+
+    cmd = BeginDeviceCmd(DeviceCmdCopy, 0);
+    cmd->srcView = srcView;
+    cmd->destView = destView;
+    cmd->src_x = src_x;
+    cmd->src_y = src_y;
+    cmd->x = dest_x;
+    cmd->y = dest_y;
+    cmd->w = width;
+    cmd->h = height;
+    CommitDeviceCmd();
+}
+
+
+/*
+ * Stop the device thread once it has drained the queue.
+ */
+
+static void
+StopDeviceThread(void)
+{
+    BeginDeviceCmd(DeviceCmdQuit, 0);
+    CommitDeviceCmd();
+    pthread_join(deviceThread, NULL);
+    pipelineActive = False;
+    free(deviceArena);
+}
+
 void ReleaseDevice() {
     dlo_final_t   fin_flags = { 0 }; 
     dlo_retcode_t err; 
 
+    if (pipelineActive)
+        StopDeviceThread();
+
     if (dl_uid) 
     { 
         /* we claimed a device */ 
@@ -0,0 +1,371 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * events.c - a small readiness-driven main loop.
+ *
+ * Callers register file descriptors, which are watched for input, and
+ * timers.  RunEventLoop() sleeps in epoll_wait() (poll() on systems without
+ * epoll) until one of them needs attention, so an idle session uses no CPU.
+ * Functions registered with AddIdleProc() run once per iteration, just
+ * before the loop goes to sleep.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <vnc2dl.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#else
+#include <poll.h>
+#endif
+
+#define MAX_EVENT_FDS 16
+#define MAX_TIMERS 16
+#define MAX_IDLE_PROCS 8
+
+typedef struct {
+  int fd;
+  EventFdProc proc;
+  void *data;
+} EventFd;
+
+typedef struct {
+  int id;                       /* 0 if the slot is free */
+  long interval;                /* ms; 0 for a one-shot timer */
+  long due;                     /* ms on the monotonic clock */
+  TimerProc proc;
+  void *data;
+} Timer;
+
+static EventFd eventFds[MAX_EVENT_FDS];
+static int nEventFds = 0;
+static Timer timers[MAX_TIMERS];
+static int nextTimerId = 1;
+static IdleProc idleProcs[MAX_IDLE_PROCS];
+static int nIdleProcs = 0;
+static Bool quitLoop = False;
+
+#ifdef USE_EPOLL
+static int epollFd = -1;
+#endif
+
+
+/*
+ * Milliseconds on a clock which is not affected by changes to the time of
+ * day.
+ */
+
+long
+CurrentTimeMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+
+#ifdef USE_EPOLL
+static Bool
+OpenEpoll(void)
+{
+  if (epollFd < 0) {
+    epollFd = epoll_create(MAX_EVENT_FDS);
+    if (epollFd < 0) {
+      fprintf(stderr,programName);
+      perror(": epoll_create");
+      return False;
+    }
+  }
+  return True;
+}
+#endif
+
+
+/*
+ * AddEventFd arranges for proc to be called whenever fd is readable.
+ */
+
+Bool
+AddEventFd(int fd, EventFdProc proc, void *data)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  if (!OpenEpoll())
+    return False;
+#endif
+
+  if (nEventFds == MAX_EVENT_FDS) {
+    fprintf(stderr,"%s: too many event sources\n",programName);
+    return False;
+  }
+
+#ifdef USE_EPOLL
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr,programName);
+    perror(": epoll_ctl");
+    return False;
+  }
+#endif
+
+  eventFds[nEventFds].fd = fd;
+  eventFds[nEventFds].proc = proc;
+  eventFds[nEventFds].data = data;
+  nEventFds++;
+  return True;
+}
+
+
+/*
+ * RemoveEventFd stops watching fd.
+ */
+
+void
+RemoveEventFd(int fd)
+{
+  int i;
+
+  for (i = 0; i < nEventFds; i++) {
+    if (eventFds[i].fd == fd) {
+#ifdef USE_EPOLL
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+      eventFds[i] = eventFds[--nEventFds];
+      return;
+    }
+  }
+}
+
+
+/*
+ * AddTimer calls proc after ms milliseconds, and then every ms milliseconds
+ * if repeat is set.  Returns an id for RemoveTimer, or 0 on failure.
+ */
+
+int
+AddTimer(long ms, Bool repeat, TimerProc proc, void *data)
+{
+  int i;
+
+  for (i = 0; i < MAX_TIMERS; i++) {
+    if (timers[i].id == 0) {
+      timers[i].id = nextTimerId++;
+      timers[i].interval = repeat ? ms : 0;
+      timers[i].due = CurrentTimeMs() + ms;
+      timers[i].proc = proc;
+      timers[i].data = data;
+      return timers[i].id;
+    }
+  }
+
+  fprintf(stderr,"%s: too many timers\n",programName);
+  return 0;
+}
+
+
+/*
+ * RemoveTimer cancels a timer.  Removing a timer which has already fired
+ * (or an id of 0) is harmless.
+ */
+
+void
+RemoveTimer(int id)
+{
+  int i;
+
+  if (id == 0)
+    return;
+
+  for (i = 0; i < MAX_TIMERS; i++) {
+    if (timers[i].id == id) {
+      timers[i].id = 0;
+      return;
+    }
+  }
+}
+
+
+/*
+ * AddIdleProc registers a function to be run each time round the loop,
+ * before waiting for events.
+ */
+
+Bool
+AddIdleProc(IdleProc proc)
+{
+  if (nIdleProcs == MAX_IDLE_PROCS)
+    return False;
+  idleProcs[nIdleProcs++] = proc;
+  return True;
+}
+
+
+/*
+ * Run any timers which are due.
+ */
+
+static void
+RunTimers(void)
+{
+  long now = CurrentTimeMs();
+  int i;
+
+  for (i = 0; i < MAX_TIMERS && !quitLoop; i++) {
+    Timer *t = &timers[i];
+
+    if (t->id == 0 || t->due > now)
+      continue;
+
+    if (t->interval) {
+      t->due += t->interval;
+      if (t->due <= now)        /* don't try to catch up after a stall */
+        t->due = now + t->interval;
+    } else {
+      t->id = 0;
+    }
+    t->proc(t->data);
+  }
+}
+
+
+/*
+ * Return the number of milliseconds until the next timer is due, or -1 if
+ * there are none.
+ */
+
+static long
+NextTimeout(void)
+{
+  long now = CurrentTimeMs();
+  long wait = -1;
+  int i;
+
+  for (i = 0; i < MAX_TIMERS; i++) {
+    if (timers[i].id == 0)
+      continue;
+    if (timers[i].due <= now)
+      return 0;
+    if (wait < 0 || timers[i].due - now < wait)
+      wait = timers[i].due - now;
+  }
+
+  return wait;
+}
+
+
+/*
+ * Dispatch input on fd to its handler.
+ */
+
+static void
+DispatchFd(int fd)
+{
+  int i;
+
+  for (i = 0; i < nEventFds; i++) {
+    if (eventFds[i].fd == fd) {
+      eventFds[i].proc(fd, eventFds[i].data);
+      return;
+    }
+  }
+}
+
+
+/*
+ * RunEventLoop runs until QuitEventLoop() is called.
+ */
+
+void
+RunEventLoop(void)
+{
+  int i, n;
+  long wait;
+#ifdef USE_EPOLL
+  struct epoll_event events[MAX_EVENT_FDS];
+#else
+  struct pollfd fds[MAX_EVENT_FDS];
+  int nfds;
+#endif
+
+#ifdef USE_EPOLL
+  if (!OpenEpoll())
+    return;
+#endif
+
+  quitLoop = False;
+
+  while (!quitLoop) {
+    RunTimers();
+
+    for (i = 0; i < nIdleProcs && !quitLoop; i++)
+      idleProcs[i]();
+
+    if (quitLoop)
+      break;
+
+    wait = NextTimeout();
+
+#ifdef USE_EPOLL
+    n = epoll_wait(epollFd, events, MAX_EVENT_FDS, (int)wait);
+#else
+    nfds = nEventFds;
+    for (i = 0; i < nfds; i++) {
+      fds[i].fd = eventFds[i].fd;
+      fds[i].events = POLLIN;
+    }
+    n = poll(fds, nfds, (int)wait);
+#endif
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,programName);
+      perror(": event wait");
+      return;
+    }
+
+#ifdef USE_EPOLL
+    for (i = 0; i < n && !quitLoop; i++)
+      DispatchFd(events[i].data.fd);
+#else
+    for (i = 0; i < nfds && !quitLoop; i++) {
+      if (fds[i].revents)
+        DispatchFd(fds[i].fd);
+    }
+#endif
+  }
+}
+
+
+/*
+ * QuitEventLoop makes RunEventLoop return after the current callback.
+ */
+
+void
+QuitEventLoop(void)
+{
+  quitLoop = True;
+}
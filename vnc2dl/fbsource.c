@@ -0,0 +1,353 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * fbsource.c - show a local framebuffer file instead of an RFB session.
+ *
+ * With -fbfile, nothing is fetched over the network.  Xvfb started with
+ * -fbdir keeps its screen in an XWD-format file which it updates through a
+ * shared mapping.  We map the same file, and on a timer compare it in tiles
+ * against a shadow copy of what the device is showing.  Each horizontal run
+ * of changed tiles is converted to the device's pixel format and sent with
+ * CopyDataToScreen().  If the file is replaced (the X server restarted), it
+ * is mapped again and the whole screen is resent.
+ *
+ * Only 32 bits per pixel TrueColor with 8-bit channels is handled, which is
+ * what Xvfb produces at depth 24.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vnc2dl.h>
+
+#define FB_TILE_W 64
+#define FB_TILE_H 32
+
+/*
+ * An XWD file starts with 25 CARD32s, followed by the window name, then
+ * ncolors 12-byte colormap entries, then the pixels.  These are the ones we
+ * need.
+ */
+
+#define SZ_XWD_HEADER (25 * 4)
+#define XWD_FILE_VERSION 7
+
+#define XWD_HEADER_SIZE 0
+#define XWD_VERSION 1
+#define XWD_WIDTH 4
+#define XWD_HEIGHT 5
+#define XWD_BYTE_ORDER 7
+#define XWD_BITS_PER_PIXEL 11
+#define XWD_BYTES_PER_LINE 12
+#define XWD_VISUAL_CLASS 13
+#define XWD_RED_MASK 14
+#define XWD_GREEN_MASK 15
+#define XWD_BLUE_MASK 16
+#define XWD_NCOLORS 19
+
+#define SZ_XWD_COLOR 12
+#define XWD_TRUE_COLOR 4
+#define XWD_LSB_FIRST 0
+
+static char *fbPath = NULL;
+static int fbFd = -1;
+static char *fbMap = NULL;
+static size_t fbMapSize;
+static dev_t fbDev;
+static ino_t fbIno;
+
+static char *fbPixels;			/* start of pixel data in fbMap */
+static int fbWidth, fbHeight, fbStride;
+static Bool fbLSBFirst;
+static int redShift, greenShift, blueShift;
+
+static char *shadow = NULL;		/* what the device has, in file format */
+static uint32_t *staging = NULL;	/* one run of tiles, in device format */
+static Bool fullUpdate;
+
+
+/*
+ * Return the position of the lowest set bit in mask, or -1 unless mask is
+ * exactly eight contiguous bits.
+ */
+
+static int
+MaskShift(CARD32 mask)
+{
+  int shift = 0;
+
+  if (mask == 0)
+    return -1;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    shift++;
+  }
+  return mask == 0xff ? shift : -1;
+}
+
+
+/*
+ * Read header field i.  Xvfb writes the header most significant byte first,
+ * but accept files written in host order too.
+ */
+
+static CARD32
+XwdField(char *hdr, int i, Bool swapped)
+{
+  CARD32 v = RD_CARD32(hdr + i * 4);
+
+  if (swapped)
+    v = ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+        ((v >> 8) & 0xff00) | ((v >> 24) & 0xff);
+  return v;
+}
+
+
+static void
+UnmapFramebuffer(void)
+{
+  if (fbMap)
+    munmap(fbMap, fbMapSize);
+  if (fbFd >= 0)
+    close(fbFd);
+  fbMap = NULL;
+  fbFd = -1;
+}
+
+
+/*
+ * Map the framebuffer file and check that it's something we can show.
+ */
+
+static Bool
+MapFramebuffer(void)
+{
+  struct stat st;
+  Bool swapped = False;
+  CARD32 pixelOffset;
+  int width, height, stride;
+
+  fbFd = open(fbPath, O_RDONLY);
+  if (fbFd < 0 || fstat(fbFd, &st) < 0) {
+    fprintf(stderr,"%s: %s: %s\n",programName,fbPath,strerror(errno));
+    UnmapFramebuffer();
+    return False;
+  }
+
+  if (st.st_size < SZ_XWD_HEADER) {
+    fprintf(stderr,"%s: %s is not an XWD file\n",programName,fbPath);
+    UnmapFramebuffer();
+    return False;
+  }
+
+  fbMapSize = st.st_size;
+  fbDev = st.st_dev;
+  fbIno = st.st_ino;
+  fbMap = mmap(NULL, fbMapSize, PROT_READ, MAP_SHARED, fbFd, 0);
+  if (fbMap == MAP_FAILED) {
+    fprintf(stderr,programName);
+    perror(": mmap");
+    fbMap = NULL;
+    UnmapFramebuffer();
+    return False;
+  }
+
+  if (XwdField(fbMap, XWD_VERSION, False) != XWD_FILE_VERSION)
+    swapped = True;
+
+  if (XwdField(fbMap, XWD_VERSION, swapped) != XWD_FILE_VERSION) {
+    fprintf(stderr,"%s: %s is not an XWD file\n",programName,fbPath);
+    UnmapFramebuffer();
+    return False;
+  }
+
+  width = XwdField(fbMap, XWD_WIDTH, swapped);
+  height = XwdField(fbMap, XWD_HEIGHT, swapped);
+  stride = XwdField(fbMap, XWD_BYTES_PER_LINE, swapped);
+  fbLSBFirst = XwdField(fbMap, XWD_BYTE_ORDER, swapped) == XWD_LSB_FIRST;
+  redShift = MaskShift(XwdField(fbMap, XWD_RED_MASK, swapped));
+  greenShift = MaskShift(XwdField(fbMap, XWD_GREEN_MASK, swapped));
+  blueShift = MaskShift(XwdField(fbMap, XWD_BLUE_MASK, swapped));
+  pixelOffset = XwdField(fbMap, XWD_HEADER_SIZE, swapped) +
+    XwdField(fbMap, XWD_NCOLORS, swapped) * SZ_XWD_COLOR;
+
+  if (XwdField(fbMap, XWD_BITS_PER_PIXEL, swapped) != 32 ||
+      XwdField(fbMap, XWD_VISUAL_CLASS, swapped) != XWD_TRUE_COLOR ||
+      redShift < 0 || greenShift < 0 || blueShift < 0) {
+    fprintf(stderr,"%s: %s: only 32bpp TrueColor framebuffers are supported\n",
+	    programName,fbPath);
+    UnmapFramebuffer();
+    return False;
+  }
+
+  if (stride < width * 4 ||
+      pixelOffset + (unsigned long)stride * height > fbMapSize) {
+    fprintf(stderr,"%s: %s is truncated\n",programName,fbPath);
+    UnmapFramebuffer();
+    return False;
+  }
+
+  fbPixels = fbMap + pixelOffset;
+
+  /* The shadow has the file's layout, so a new stride needs a new one. */
+  if (width != fbWidth || height != fbHeight || stride != fbStride ||
+      !shadow) {
+    free(shadow);
+    free(staging);
+    fbWidth = width;
+    fbHeight = height;
+    fbStride = stride;
+    shadow = malloc((size_t)fbStride * fbHeight);
+    staging = malloc((size_t)fbWidth * FB_TILE_H * 4);
+    if (!shadow || !staging) {
+      fprintf(stderr,"%s: out of memory\n",programName);
+      exit(1);
+    }
+    fprintf(stderr,"Showing %dx%d framebuffer from %s\n",
+	    fbWidth,fbHeight,fbPath);
+  }
+
+  fullUpdate = True;
+  return True;
+}
+
+
+/*
+ * Has the tile at (x,y) changed since it was last sent?
+ */
+
+static Bool
+TileChanged(int x, int y, int w, int h)
+{
+  unsigned long off = (unsigned long)y * fbStride + x * 4;
+  int row;
+
+  for (row = 0; row < h; row++, off += fbStride) {
+    if (memcmp(fbPixels + off, shadow + off, w * 4) != 0)
+      return True;
+  }
+  return False;
+}
+
+
+/*
+ * Update the shadow copy of a region and send it to the device.
+ */
+
+static void
+SendRegion(int x, int y, int w, int h)
+{
+  unsigned long off = (unsigned long)y * fbStride + x * 4;
+  uint32_t *out = staging;
+  unsigned char *p;
+  CARD32 pix;
+  int row, i;
+
+  for (row = 0; row < h; row++, off += fbStride) {
+    memcpy(shadow + off, fbPixels + off, w * 4);
+    p = (unsigned char *)shadow + off;
+    for (i = 0; i < w; i++, p += 4) {
+      if (fbLSBFirst)
+	pix = p[0] | (p[1] << 8) | (p[2] << 16) | ((CARD32)p[3] << 24);
+      else
+	pix = RD_CARD32(p);
+      *out++ = (((pix >> redShift) & 0xff) << myFormat.redShift) |
+	       (((pix >> greenShift) & 0xff) << myFormat.greenShift) |
+	       (((pix >> blueShift) & 0xff) << myFormat.blueShift);
+    }
+  }
+
+  CopyDataToScreen((char *)staging, x, y, w, h);
+}
+
+
+/*
+ * If the file has been replaced since we mapped it, map the new one.
+ */
+
+static Bool
+CheckFramebufferFile(void)
+{
+  struct stat st;
+
+  if (fbMap && stat(fbPath, &st) == 0 &&
+      st.st_dev == fbDev && st.st_ino == fbIno && (size_t)st.st_size == fbMapSize)
+    return True;
+
+  UnmapFramebuffer();
+  return MapFramebuffer();
+}
+
+
+/*
+ * PollFramebuffer runs on a timer and sends whatever has changed, as runs
+ * of adjacent changed tiles along each row of tiles.
+ */
+
+static void
+PollFramebuffer(void *data)
+{
+  int tx, ty, tw, th, runStart;
+  Bool changed;
+
+  if (!CheckFramebufferFile())
+    return;			/* try again next time */
+
+  for (ty = 0; ty < fbHeight; ty += FB_TILE_H) {
+    th = fbHeight - ty < FB_TILE_H ? fbHeight - ty : FB_TILE_H;
+    runStart = -1;
+
+    for (tx = 0; tx < fbWidth; tx += FB_TILE_W) {
+      tw = fbWidth - tx < FB_TILE_W ? fbWidth - tx : FB_TILE_W;
+      changed = fullUpdate || TileChanged(tx, ty, tw, th);
+
+      if (changed && runStart < 0) {
+	runStart = tx;
+      } else if (!changed && runStart >= 0) {
+	SendRegion(runStart, ty, tx - runStart, th);
+	runStart = -1;
+      }
+    }
+    if (runStart >= 0)
+      SendRegion(runStart, ty, fbWidth - runStart, th);
+  }
+
+  fullUpdate = False;
+}
+
+
+/*
+ * StartFramebufferSource maps the framebuffer file at path and arranges for
+ * it to be checked for changes every appData.fbInterval milliseconds.
+ */
+
+Bool
+StartFramebufferSource(const char *path)
+{
+  fbPath = strdup(path);
+
+  if (!MapFramebuffer())
+    return False;
+
+  PollFramebuffer(NULL);
+
+  return AddTimer(appData.fbInterval, True, PollFramebuffer, NULL) != 0;
+}
@@ -27,115 +27,169 @@
  */
 
 #define HandleHextileBPP CONCAT2E(HandleHextile,BPP)
+#define FillTileBPP CONCAT2E(FillTile,BPP)
 #define CARDBPP CONCAT2E(CARD,BPP)
 #define GET_PIXEL CONCAT2E(GET_PIXEL,BPP)
 
+/*
+ * Tiles are decoded a row at a time into tileRowBuffer, which is as wide as
+ * the rectangle, and each run of tiles with detail in it is uploaded with
+ * one CopyStridedDataToScreen.  Tiles which are only background, as most of
+ * a desktop is, never go through the buffer: a run of them in the same
+ * colour becomes one FillRect.
+ */
+
+/*
+ * Fill a rectangle in the row buffer, whose rows are stride pixels apart.
+ */
+
+static void
+FillTileBPP (CARDBPP *p, int stride, int w, int h, CARDBPP pix)
+{
+    int i;
+
+    while (h-- > 0) {
+        for (i = 0; i < w; i++)
+            p[i] = pix;
+        p += stride;
+    }
+}
+
 static Bool
 HandleHextileBPP (int rx, int ry, int rw, int rh)
 {
-  CARDBPP bg, fg;
-  XGCValues gcv;
-  int i;
-  CARD8 *ptr;
-  int x, y, w, h;
-  int sx, sy, sw, sh;
-  CARD8 subencoding;
-  CARD8 nSubrects;
-
-  for (y = ry; y < ry+rh; y += 16) {
-    for (x = rx; x < rx+rw; x += 16) {
-      w = h = 16;
-      if (rx+rw - x < 16)
-	w = rx+rw - x;
-      if (ry+rh - y < 16)
-	h = ry+rh - y;
-
-      if (!ReadFromRFBServer((char *)&subencoding, 1))
-	return False;
-
-      if (subencoding & rfbHextileRaw) {
-	if (!ReadFromRFBServer(buffer, w * h * (BPP / 8)))
-	  return False;
-
-	CopyDataToScreen(buffer, x, y, w, h);
-	continue;
-      }
-
-      if (subencoding & rfbHextileBackgroundSpecified)
-	if (!ReadFromRFBServer((char *)&bg, sizeof(bg)))
-	  return False;
-
-#if (BPP == 8)
-      if (appData.useBGR233)
-	gcv.foreground = BGR233ToPixel[bg];
-      else
-#endif
-	gcv.foreground = bg;
-
-      XChangeGC(dpy, gc, GCForeground, &gcv);
-      XFillRectangle(dpy, desktopWin, gc, x, y, w, h);
-
-      if (subencoding & rfbHextileForegroundSpecified)
-	if (!ReadFromRFBServer((char *)&fg, sizeof(fg)))
-	  return False;
-
-      if (!(subencoding & rfbHextileAnySubrects)) {
-	continue;
-      }
-
-      if (!ReadFromRFBServer((char *)&nSubrects, 1))
-	return False;
-
-      ptr = (CARD8 *)buffer;
-
-      if (subencoding & rfbHextileSubrectsColoured) {
-	if (!ReadFromRFBServer(buffer, nSubrects * (2 + (BPP / 8))))
-	  return False;
-
-	for (i = 0; i < nSubrects; i++) {
-	  GET_PIXEL(fg, ptr);
-	  sx = rfbHextileExtractX(*ptr);
-	  sy = rfbHextileExtractY(*ptr);
-	  ptr++;
-	  sw = rfbHextileExtractW(*ptr);
-	  sh = rfbHextileExtractH(*ptr);
-	  ptr++;
-#if (BPP == 8)
-	  if (appData.useBGR233)
-	    gcv.foreground = BGR233ToPixel[fg];
-	  else
-#endif
-	    gcv.foreground = fg;
-
-	  XChangeGC(dpy, gc, GCForeground, &gcv);
-	  XFillRectangle(dpy, desktopWin, gc, x+sx, y+sy, sw, sh);
-	}
-
-      } else {
-	if (!ReadFromRFBServer(buffer, nSubrects * 2))
-	  return False;
-
-#if (BPP == 8)
-	if (appData.useBGR233)
-	  gcv.foreground = BGR233ToPixel[fg];
-	else
-#endif
-	  gcv.foreground = fg;
-
-	XChangeGC(dpy, gc, GCForeground, &gcv);
-
-	for (i = 0; i < nSubrects; i++) {
-	  sx = rfbHextileExtractX(*ptr);
-	  sy = rfbHextileExtractY(*ptr);
-	  ptr++;
-	  sw = rfbHextileExtractW(*ptr);
-	  sh = rfbHextileExtractH(*ptr);
-	  ptr++;
-	  XFillRectangle(dpy, desktopWin, gc, x+sx, y+sy, sw, sh);
-	}
-      }
+    CARDBPP bg = 0, fg = 0, runColour = 0;
+    CARDBPP *tile;
+    CARD8 *ptr;
+    CARD8 subencoding = 0;
+    int nSubrects, len;
+    int x, y, w = 0, h, i;
+    int sx, sy, sw, sh;
+    int runX, spanX;		/* start of the pending fill and upload, or -1 */
+    Bool end, solid;
+
+    if (tileRowBufferSize < rw * 16 * (BPP / 8)) {
+        free(tileRowBuffer);
+        tileRowBufferSize = rw * 16 * (BPP / 8);
+        tileRowBuffer = malloc(tileRowBufferSize);
+        if (!tileRowBuffer) {
+            tileRowBufferSize = 0;
+            fprintf(stderr,"%s: cannot allocate hextile buffer\n",programName);
+            return False;
+        }
     }
-  }
 
-  return True;
+    for (y = ry; y < ry + rh; y += 16) {
+        h = (ry + rh - y < 16) ? ry + rh - y : 16;
+        runX = spanX = -1;
+
+        /* One more time round at the end of the row, to finish off. */
+        for (x = rx; ; x += 16) {
+            end = (x >= rx + rw);
+            solid = False;
+
+            if (!end) {
+                w = (rx + rw - x < 16) ? rx + rw - x : 16;
+
+                if ((ptr = (CARD8 *)PeekFromRFBServer(1)) == NULL)
+                    return False;
+                subencoding = *ptr;
+                ConsumeFromRFBServer(1);
+
+                if (!(subencoding & rfbHextileRaw)) {
+                    len = 0;
+                    if (subencoding & rfbHextileBackgroundSpecified)
+                        len += BPP / 8;
+                    if (subencoding & rfbHextileForegroundSpecified)
+                        len += BPP / 8;
+                    if (len > 0) {
+                        if ((ptr = (CARD8 *)PeekFromRFBServer(len)) == NULL)
+                            return False;
+                        if (subencoding & rfbHextileBackgroundSpecified)
+                            GET_PIXEL(bg, ptr);
+                        if (subencoding & rfbHextileForegroundSpecified)
+                            GET_PIXEL(fg, ptr);
+                        ConsumeFromRFBServer(len);
+                    }
+                    solid = !(subencoding & rfbHextileAnySubrects);
+                }
+            }
+
+            /* Finish the run of solid tiles if this one doesn't extend it,
+               and the run of other tiles if this one is solid. */
+            if (runX >= 0 && (end || !solid || bg != runColour)) {
+                FillRect(runX, y, x - runX, h, runColour);
+                runX = -1;
+            }
+            if (spanX >= 0 && (end || solid)) {
+                CopyStridedDataToScreen(tileRowBuffer +
+                                        (spanX - rx) * (BPP / 8), rw,
+                                        spanX, y, x - spanX, h);
+                spanX = -1;
+            }
+            if (end)
+                break;
+
+            if (solid) {
+                if (runX < 0) {
+                    runX = x;
+                    runColour = bg;
+                }
+                continue;
+            }
+
+            if (spanX < 0)
+                spanX = x;
+            tile = (CARDBPP *)tileRowBuffer + (x - rx);
+
+            if (subencoding & rfbHextileRaw) {
+                len = w * (BPP / 8);
+                if ((ptr = (CARD8 *)PeekFromRFBServer(len * h)) == NULL)
+                    return False;
+                for (i = 0; i < h; i++)
+                    memcpy(tile + i * rw, ptr + i * len, len);
+                ConsumeFromRFBServer(len * h);
+                continue;
+            }
+
+            FillTileBPP(tile, rw, w, h, bg);
+
+            if ((ptr = (CARD8 *)PeekFromRFBServer(1)) == NULL)
+                return False;
+            nSubrects = *ptr;
+            ConsumeFromRFBServer(1);
+
+            len = nSubrects * 2;
+            if (subencoding & rfbHextileSubrectsColoured)
+                len += nSubrects * (BPP / 8);
+            if (len == 0)
+                continue;
+            if ((ptr = (CARD8 *)PeekFromRFBServer(len)) == NULL)
+                return False;
+
+            for (i = 0; i < nSubrects; i++) {
+                if (subencoding & rfbHextileSubrectsColoured)
+                    GET_PIXEL(fg, ptr);
+                sx = rfbHextileExtractX(*ptr);
+                sy = rfbHextileExtractY(*ptr);
+                ptr++;
+                sw = rfbHextileExtractW(*ptr);
+                sh = rfbHextileExtractH(*ptr);
+                ptr++;
+
+                /* Keep a bad subrectangle inside its tile. */
+                if (sx + sw > w)
+                    sw = w - sx;
+                if (sy + sh > h)
+                    sh = h - sy;
+                FillTileBPP(tile + sy * rw + sx, rw, sw, sh, fg);
+            }
+            ConsumeFromRFBServer(len);
+        }
+    }
+
+    return True;
 }
+
+#undef FillTileBPP
+#undef GET_PIXEL
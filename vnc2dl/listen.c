@@ -47,12 +47,16 @@ listenForIncomingConnections()
   struct utsname hostinfo;
   uname(&hostinfo);
 
-  listenSocket = ListenAtTcpPort(appData.listenPort);
-
-  if (listenSocket < 0) exit(1);
-
-  fprintf(stderr,"%s Listening on port %d\n",
-	  programName, appData.listenPort);
+  if (appData.listenUnix) {
+    listenSocket = ListenAtUnixPath(appData.listenUnix);
+    if (listenSocket < 0) exit(1);
+    fprintf(stderr,"%s Listening on %s\n", programName, appData.listenUnix);
+  } else {
+    listenSocket = ListenAtTcpPort(appData.listenPort);
+    if (listenSocket < 0) exit(1);
+    fprintf(stderr,"%s Listening on port %d\n",
+	    programName, appData.listenPort);
+  }
   fprintf(stderr,"%s -listen: Command line errors are not reported until "
 	  "a connection comes in.\n", programName);
 
@@ -69,7 +73,10 @@ listenForIncomingConnections()
     select(FD_SETSIZE, &fds, NULL, NULL, NULL);
 
     if (FD_ISSET(listenSocket, &fds)) {
-      rfbsock = AcceptTcpConnection(listenSocket);
+      if (appData.listenUnix)
+        rfbsock = AcceptUnixConnection(listenSocket);
+      else
+        rfbsock = AcceptTcpConnection(listenSocket);
       if (rfbsock < 0) exit(1);
       if (!SetNonBlocking(rfbsock)) exit(1);
 
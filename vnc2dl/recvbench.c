@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * recvbench.c - measure the receive path over loopback.
+ *
+ * A thread writes a stream of bytes to a loopback TCP connection, and the
+ * main thread reads it through PeekFromRFBServer and ConsumeFromRFBServer,
+ * as the decoders do, then prints the rate.  With -iouring the reads go
+ * through uring.c instead of readv().  This is how the numbers for
+ * -iouring were obtained; it is built with "make recvbench" and is not
+ * installed.
+ *
+ *   recvbench [-iouring] [-write <BYTES>] [-peek <BYTES>] [-total <MB>]
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "vnc2dl.h"
+
+char *programName;
+
+static int port;
+static int writeSize = 1024 * 1024;
+static long long total = 1024LL * 1024 * 1024;
+
+
+/*
+ * Writer connects to the listening socket and sends total bytes to it, in
+ * writes of writeSize bytes.
+ */
+
+static void *
+Writer(void *arg)
+{
+  struct sockaddr_in addr;
+  long long left = total;
+  char *buf;
+  int sock, n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  buf = calloc(writeSize, 1);
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (!buf || sock < 0 ||
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr,"%s: ",programName);
+    perror("writer");
+    exit(1);
+  }
+
+  while (left > 0) {
+    n = left < writeSize ? left : writeSize;
+    if ((n = write(sock, buf, n)) <= 0)
+      break;
+    left -= n;
+  }
+
+  close(sock);
+  free(buf);
+  return NULL;
+}
+
+
+static void
+Usage(void)
+{
+  fprintf(stderr,
+	  "usage: %s [-iouring] [-write <BYTES>] [-peek <BYTES>] [-total <MB>]\n",
+	  programName);
+  exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  struct timespec start, end;
+  unsigned int peekSize = 16 * 1024, n;
+  long long left;
+  double secs;
+  pthread_t writer;
+  int listenSock, i;
+
+  programName = argv[0];
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-iouring") == 0) {
+      appData.ioUring = True;
+    } else if (strcmp(argv[i], "-write") == 0 && i + 1 < argc) {
+      writeSize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-peek") == 0 && i + 1 < argc) {
+      peekSize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-total") == 0 && i + 1 < argc) {
+      total = atoll(argv[++i]) * 1024 * 1024;
+    } else {
+      Usage();
+    }
+  }
+  if (writeSize <= 0 || peekSize == 0 || peekSize > RFB_MAX_PEEK || total <= 0)
+    Usage();
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listenSock = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenSock < 0 ||
+      bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listenSock, 1) < 0 ||
+      getsockname(listenSock, (struct sockaddr *)&addr, &addrLen) < 0) {
+    fprintf(stderr,"%s: ",programName);
+    perror("listen");
+    exit(1);
+  }
+  port = ntohs(addr.sin_port);
+
+  if (pthread_create(&writer, NULL, Writer, NULL) != 0) {
+    fprintf(stderr,"%s: cannot start the writer thread\n",programName);
+    exit(1);
+  }
+
+  rfbsock = accept(listenSock, NULL, NULL);
+  if (rfbsock < 0) {
+    fprintf(stderr,"%s: ",programName);
+    perror("accept");
+    exit(1);
+  }
+  close(listenSock);
+
+  if (appData.ioUring && !UseUringReceive())
+    exit(1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (left = total; left > 0; left -= n) {
+    n = left < peekSize ? left : peekSize;
+    if (!PeekFromRFBServer(n)) {
+      fprintf(stderr,"%s: stream ended early\n",programName);
+      exit(1);
+    }
+    ConsumeFromRFBServer(n);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_join(writer, NULL);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%s, %d byte writes, %u byte peeks: %.0f MB/s\n",
+	 appData.ioUring ? "io_uring" : "readv", writeSize, peekSize,
+	 total / 1048576.0 / secs);
+  return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * refine.c - replace JPEG areas with exact pixels once they stop changing.
+ *
+ * JPEG keeps a busy screen moving over a slow link, but leaves blurred text
+ * behind when things settle down.  We remember which parts of the screen
+ * last came as JPEG, and when one of them hasn't changed for
+ * appData.refineDelay milliseconds, we ask for it again without a JPEG
+ * quality level, which stops the server using JPEG, and then put the
+ * quality level back when the lossless copy has arrived.
+ *
+ * The lossy areas are kept as a short list of rectangles.  Rectangles which
+ * overlap are merged, and when the list is full a new one is merged into
+ * whichever rectangle grows least, so at worst we ask for a bit more than
+ * we need.
+ */
+
+#include <vnc2dl.h>
+
+#define REFINE_MAX_RECTS 32
+#define REFINE_CHECK_MS 250
+#define REFINE_TIMEOUT_MS 2000	/* give up waiting for lossless pixels */
+
+typedef struct {
+  int x, y, w, h;
+  long drawn;			/* when JPEG was last drawn here */
+} LossyRect;
+
+static LossyRect lossy[REFINE_MAX_RECTS];
+static int nLossy = 0;
+static int checkTimer = 0;
+
+/* The refinement we are waiting for, if any. */
+static Bool refining = False;
+static LossyRect requested[REFINE_MAX_RECTS];
+static int nRequested = 0;
+static long requestedArea, receivedArea;
+static long refineStart;
+
+
+/*
+ * Overlap returns the area of the intersection of r with the given
+ * rectangle, and fills in the intersection if out isn't NULL.
+ */
+
+static long
+Overlap(LossyRect *r, int x, int y, int w, int h, LossyRect *out)
+{
+  int x1 = (r->x > x) ? r->x : x;
+  int y1 = (r->y > y) ? r->y : y;
+  int x2 = (r->x + r->w < x + w) ? r->x + r->w : x + w;
+  int y2 = (r->y + r->h < y + h) ? r->y + r->h : y + h;
+
+  if (x2 <= x1 || y2 <= y1)
+    return 0;
+  if (out) {
+    out->x = x1;
+    out->y = y1;
+    out->w = x2 - x1;
+    out->h = y2 - y1;
+  }
+  return (long)(x2 - x1) * (y2 - y1);
+}
+
+
+/*
+ * Extend r to cover the given rectangle as well.
+ */
+
+static void
+Merge(LossyRect *r, int x, int y, int w, int h)
+{
+  int x2 = (r->x + r->w > x + w) ? r->x + r->w : x + w;
+  int y2 = (r->y + r->h > y + h) ? r->y + r->h : y + h;
+
+  if (x < r->x)
+    r->x = x;
+  if (y < r->y)
+    r->y = y;
+  r->w = x2 - r->x;
+  r->h = y2 - r->y;
+}
+
+
+/*
+ * Add a lossy rectangle to the list.
+ */
+
+static void
+AddLossy(int x, int y, int w, int h, long drawn)
+{
+  LossyRect r;
+  long growth, best;
+  int i, merge;
+
+  r.x = x;
+  r.y = y;
+  r.w = w;
+  r.h = h;
+  r.drawn = drawn;
+
+  /* Absorb anything the new rectangle overlaps.  It may grow into others as
+     it goes, so start again after each one. */
+  i = 0;
+  while (i < nLossy) {
+    if (Overlap(&lossy[i], r.x, r.y, r.w, r.h, NULL) == 0) {
+      i++;
+      continue;
+    }
+    Merge(&r, lossy[i].x, lossy[i].y, lossy[i].w, lossy[i].h);
+    if (lossy[i].drawn > r.drawn)
+      r.drawn = lossy[i].drawn;
+    lossy[i] = lossy[--nLossy];
+    i = 0;
+  }
+
+  if (nLossy < REFINE_MAX_RECTS) {
+    lossy[nLossy++] = r;
+    return;
+  }
+
+  merge = 0;
+  best = -1;
+  for (i = 0; i < nLossy; i++) {
+    LossyRect m = lossy[i];
+    Merge(&m, r.x, r.y, r.w, r.h);
+    growth = (long)m.w * m.h - (long)lossy[i].w * lossy[i].h;
+    if (best < 0 || growth < best) {
+      best = growth;
+      merge = i;
+    }
+  }
+  Merge(&lossy[merge], r.x, r.y, r.w, r.h);
+  if (r.drawn > lossy[merge].drawn)
+    lossy[merge].drawn = r.drawn;
+}
+
+
+/*
+ * The lossless pixels have arrived, or we have given up on them: let the
+ * server use JPEG again.
+ */
+
+static Bool
+EndRefinement(void)
+{
+  refining = False;
+  nRequested = 0;
+  return SetLossless(False);
+}
+
+
+/*
+ * RefineCheck runs on a timer while there is anything lossy on the screen,
+ * and asks for lossless copies of the areas which have settled down.
+ */
+
+static void
+RefineCheck(void *data)
+{
+  long now = CurrentTimeMs();
+  LossyRect *r;
+  int i;
+
+  if (refining) {
+    if (now - refineStart < REFINE_TIMEOUT_MS)
+      return;
+    if (appData.debug)
+      fprintf(stderr,"Refinement timed out (%ld of %ld pixels)\n",
+	      receivedArea, requestedArea);
+    if (!EndRefinement())
+      QuitEventLoop();
+    return;
+  }
+
+  if (nLossy == 0) {
+    RemoveTimer(checkTimer);
+    checkTimer = 0;
+    return;
+  }
+
+  /* Only the viewport is on the device; anything else will be fetched
+     afresh if the viewport moves over it. */
+  nRequested = 0;
+  requestedArea = 0;
+  i = 0;
+  while (i < nLossy) {
+    r = &lossy[i];
+    if (now - r->drawn < appData.refineDelay) {
+      i++;
+      continue;
+    }
+    if (ClipToViewport(&r->x, &r->y, &r->w, &r->h)) {
+      requested[nRequested++] = *r;
+      requestedArea += (long)r->w * r->h;
+    }
+    lossy[i] = lossy[--nLossy];
+  }
+
+  if (nRequested == 0)
+    return;
+
+  if (appData.debug)
+    fprintf(stderr,"Refining %d areas (%ld pixels)\n",
+	    nRequested, requestedArea);
+
+  if (!SetLossless(True)) {
+    QuitEventLoop();
+    return;
+  }
+  for (i = 0; i < nRequested; i++) {
+    r = &requested[i];
+    if (!SendFramebufferUpdateRequest(r->x, r->y, r->w, r->h, False)) {
+      QuitEventLoop();
+      return;
+    }
+  }
+
+  refining = True;
+  receivedArea = 0;
+  refineStart = now;
+}
+
+
+/*
+ * RefineMarkLossy is called when a rectangle has been drawn from JPEG data.
+ */
+
+void
+RefineMarkLossy(int x, int y, int w, int h)
+{
+  if (appData.refineDelay <= 0)
+    return;
+
+  AddLossy(x, y, w, h, CurrentTimeMs());
+
+  if (!checkTimer)
+    checkTimer = AddTimer(REFINE_CHECK_MS, True, RefineCheck, NULL);
+}
+
+
+/*
+ * RefineCovered is called for each rectangle of an update before it is
+ * drawn.  Lossy areas it covers completely are forgotten, and if a
+ * refinement is in progress, it counts towards the pixels we asked for.
+ */
+
+void
+RefineCovered(int x, int y, int w, int h)
+{
+  LossyRect *r;
+  int i;
+
+  i = 0;
+  while (i < nLossy) {
+    r = &lossy[i];
+    if (Overlap(r, x, y, w, h, NULL) == (long)r->w * r->h)
+      lossy[i] = lossy[--nLossy];
+    else
+      i++;
+  }
+
+  if (!refining)
+    return;
+
+  for (i = 0; i < nRequested; i++)
+    receivedArea += Overlap(&requested[i], x, y, w, h, NULL);
+
+  if (receivedArea >= requestedArea && !EndRefinement())
+    QuitEventLoop();
+}
+
+
+/*
+ * RefineCopied is called for a CopyRect, which takes any lossy pixels in
+ * the source along with it.
+ */
+
+void
+RefineCopied(int srcX, int srcY, int w, int h, int dstX, int dstY)
+{
+  LossyRect moved[REFINE_MAX_RECTS];
+  int i, n = 0;
+
+  for (i = 0; i < nLossy; i++) {
+    if (Overlap(&lossy[i], srcX, srcY, w, h, &moved[n])) {
+      moved[n].x += dstX - srcX;
+      moved[n].y += dstY - srcY;
+      moved[n].drawn = lossy[i].drawn;
+      n++;
+    }
+  }
+
+  RefineCovered(dstX, dstY, w, h);
+
+  for (i = 0; i < n; i++)
+    AddLossy(moved[i].x, moved[i].y, moved[i].w, moved[i].h, moved[i].drawn);
+}
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pwd.h>
+#include <pthread.h>
 #include <vnc2dl.h>
 #include <vncauth.h>
 #include <zlib.h>
@@ -39,9 +40,18 @@ static int SelectSecurityType(void);
 static Bool PerformAuthenticationTight(void);
 static Bool AuthenticateVNC(void);
 static Bool AuthenticateNone(void);
+static Bool AuthenticateVeNCrypt(void);
 static Bool ReadAuthenticationResult(void);
 static Bool ReadInteractionCaps(void);
+static Bool SetServerScale(void);
 static Bool ReadCapabilityList(CapsContainer *caps, int count);
+static Bool HandleEndOfContinuousUpdates(void);
+static Bool HandleFence(void);
+static Bool SendFlowFence(void);
+static Bool RequestNextUpdate(void);
+static Bool RequestExposed(int x, int y, int w, int h);
+static Bool ResizeDesktop(int w, int h);
+static Bool FollowPointer(int x, int y);
 
 static Bool HandleRRE8(int rx, int ry, int rw, int rh);
 static Bool HandleRRE16(int rx, int ry, int rw, int rh);
@@ -70,44 +80,67 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
                               int compressedLen);
 
 
-int rfbsock;
-char *desktopName;
+PER_CONNECTION int rfbsock;
+PER_CONNECTION char *desktopName;
 rfbPixelFormat myFormat;
-rfbServerInitMsg si;
-char *serverCutText = NULL;
-Bool newServerCutText = False;
+PER_CONNECTION rfbServerInitMsg si;
+PER_CONNECTION char *serverCutText = NULL;
+PER_CONNECTION Bool newServerCutText = False;
 
 int endianTest = 1;
 
-static int protocolMinorVersion;
-static Bool tightVncProtocol = False;
-static CapsContainer *tunnelCaps;    /* known tunneling/encryption methods */
-static CapsContainer *authCaps;      /* known authentication schemes       */
-static CapsContainer *serverMsgCaps; /* known non-standard server messages */
-static CapsContainer *clientMsgCaps; /* known non-standard client messages */
-static CapsContainer *encodingCaps;  /* known encodings besides Raw        */
+static PER_CONNECTION int protocolMinorVersion;
+static PER_CONNECTION Bool tightVncProtocol = False;
+static PER_CONNECTION CapsContainer *tunnelCaps;    /* known tunneling/encryption methods */
+static PER_CONNECTION CapsContainer *authCaps;      /* known authentication schemes       */
+static PER_CONNECTION CapsContainer *serverMsgCaps; /* known non-standard server messages */
+static PER_CONNECTION CapsContainer *clientMsgCaps; /* known non-standard client messages */
+static PER_CONNECTION CapsContainer *encodingCaps;  /* known encodings besides Raw        */
+
+/* Continuous updates and fences; see HandleFence(). */
+PER_CONNECTION Bool continuousUpdates = False;
+static PER_CONNECTION Bool serverHasFence = False;
+static PER_CONNECTION Bool serverHasContinuous = False;
+static PER_CONNECTION Bool continuousPaused = False;
+static PER_CONNECTION Bool fencePending = False;
+static PER_CONNECTION long fenceMinRtt = -1;
+
+/* How much longer than the quickest round trip seen a fence may take before
+   we decide that updates are queueing up and pause them. */
+#define FENCE_MAX_QUEUE_MS 100
+
+/* Requests held back until the device is ready; see RequestNextUpdate(). */
+#define PACE_MIN_MS 2
+static PER_CONNECTION int paceTimer = 0;
+
+/* Set while refine.c wants updates without JPEG; see SetLossless(). */
+static PER_CONNECTION Bool lossless = False;
+
+/* What -scale divides the desktop by, once worked out; see SetServerScale().
+   Every connection of a striped session uses the same. */
+static int scaleFactor = 0;
 
 
 /* Note that the CoRRE encoding uses this buffer and assumes it is big enough
    to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes.
-   Hextile also assumes it is big enough to hold 16 * 16 * 32 bits.
-   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes. */
+   Zlib assumes it holds at least one row of the widest rectangle, 65535 * 32
+   bits.  Tight encoding assumes BUFFER_SIZE is at least 16384 bytes. */
 
 #define BUFFER_SIZE (640*480)
-static char buffer[BUFFER_SIZE];
+static PER_CONNECTION char buffer[BUFFER_SIZE];
+
+
+/* The zlib encoding inflates into the "buffer" above, a band of rows at a
+   time.  The stream carries on from one rectangle to the next. */
 
+static PER_CONNECTION z_stream decompStream;
+static PER_CONNECTION Bool decompStreamInited = False;
 
-/* The zlib encoding requires expansion/decompression/deflation of the
-   compressed data in the "buffer" above into another, result buffer.
-   However, the size of the result buffer can be determined precisely
-   based on the bitsPerPixel, height and width of the rectangle.  We
-   allocate this buffer one time to be the full size of the buffer. */
 
-static int raw_buffer_size = -1;
-static char *raw_buffer;
+/* Hextile decodes a row of 16-pixel-high tiles at a time into this. */
 
-static z_stream decompStream;
-static Bool decompStreamInited = False;
+static PER_CONNECTION char *tileRowBuffer = NULL;
+static PER_CONNECTION int tileRowBufferSize = 0;
 
 
 /*
@@ -116,22 +149,22 @@ static Bool decompStreamInited = False;
 
 /* Separate buffer for compressed data. */
 #define ZLIB_BUFFER_SIZE 512
-static char zlib_buffer[ZLIB_BUFFER_SIZE];
+static PER_CONNECTION char zlib_buffer[ZLIB_BUFFER_SIZE];
 
 /* Four independent compression streams for zlib library. */
-static z_stream zlibStream[4];
-static Bool zlibStreamActive[4] = {
+static PER_CONNECTION z_stream zlibStream[4];
+static PER_CONNECTION Bool zlibStreamActive[4] = {
   False, False, False, False
 };
 
 /* Filter stuff. Should be initialized by filter initialization code. */
-static Bool cutZeros;
-static int rectWidth, rectColors;
-static char tightPalette[256*4];
-static CARD8 tightPrevRow[2048*3*sizeof(CARD16)];
+static PER_CONNECTION Bool cutZeros;
+static PER_CONNECTION int rectWidth, rectColors;
+static PER_CONNECTION char tightPalette[256*4];
+static PER_CONNECTION CARD8 tightPrevRow[2048*3*sizeof(CARD16)];
 
 /* JPEG decoder state. */
-static Bool jpegError;
+static PER_CONNECTION Bool jpegError;
 
 
 /*
@@ -158,26 +191,26 @@ InitCapabilities(void)
           sig_rfbEncodingCopyRect, "Standard CopyRect encoding");
   CapsAdd(encodingCaps, rfbEncodingRRE, rfbStandardVendor,
           sig_rfbEncodingRRE, "Standard RRE encoding");
-  // CapsAdd(encodingCaps, rfbEncodingCoRRE, rfbStandardVendor,
-  //         sig_rfbEncodingCoRRE, "Standard CoRRE encoding");
-  // CapsAdd(encodingCaps, rfbEncodingHextile, rfbStandardVendor,
-  //         sig_rfbEncodingHextile, "Standard Hextile encoding");
-  // CapsAdd(encodingCaps, rfbEncodingZlib, rfbTridiaVncVendor,
-  //         sig_rfbEncodingZlib, "Zlib encoding from TridiaVNC");
-  // CapsAdd(encodingCaps, rfbEncodingTight, rfbTightVncVendor,
-  //         sig_rfbEncodingTight, "Tight encoding by Constantin Kaplinsky");
+  CapsAdd(encodingCaps, rfbEncodingCoRRE, rfbStandardVendor,
+          sig_rfbEncodingCoRRE, "Standard CoRRE encoding");
+  CapsAdd(encodingCaps, rfbEncodingHextile, rfbStandardVendor,
+          sig_rfbEncodingHextile, "Standard Hextile encoding");
+  CapsAdd(encodingCaps, rfbEncodingZlib, rfbTridiaVncVendor,
+          sig_rfbEncodingZlib, "Zlib encoding from TridiaVNC");
+  CapsAdd(encodingCaps, rfbEncodingTight, rfbTightVncVendor,
+          sig_rfbEncodingTight, "Tight encoding by Constantin Kaplinsky");
 
   /* Supported "fake" encoding types */
   CapsAdd(encodingCaps, rfbEncodingCompressLevel0, rfbTightVncVendor,
           sig_rfbEncodingCompressLevel0, "Compression level");
   CapsAdd(encodingCaps, rfbEncodingQualityLevel0, rfbTightVncVendor,
           sig_rfbEncodingQualityLevel0, "JPEG quality level");
-  // CapsAdd(encodingCaps, rfbEncodingXCursor, rfbTightVncVendor,
-  //         sig_rfbEncodingXCursor, "X-style cursor shape update");
-  // CapsAdd(encodingCaps, rfbEncodingRichCursor, rfbTightVncVendor,
-  //         sig_rfbEncodingRichCursor, "Rich-color cursor shape update");
-  // CapsAdd(encodingCaps, rfbEncodingPointerPos, rfbTightVncVendor,
-  //         sig_rfbEncodingPointerPos, "Pointer position update");
+  CapsAdd(encodingCaps, rfbEncodingXCursor, rfbTightVncVendor,
+          sig_rfbEncodingXCursor, "X-style cursor shape update");
+  CapsAdd(encodingCaps, rfbEncodingRichCursor, rfbTightVncVendor,
+          sig_rfbEncodingRichCursor, "Rich-color cursor shape update");
+  CapsAdd(encodingCaps, rfbEncodingPointerPos, rfbTightVncVendor,
+          sig_rfbEncodingPointerPos, "Pointer position update");
   // CapsAdd(encodingCaps, rfbEncodingLastRect, rfbTightVncVendor,
   //         sig_rfbEncodingLastRect, "LastRect protocol extension");
 }
@@ -190,14 +223,16 @@ InitCapabilities(void)
 Bool
 ConnectToRFBServer(const char *hostname, int port)
 {
-  unsigned int host;
-
-  if (!StringToIPAddr(hostname, &host)) {
-    fprintf(stderr,"Couldn't convert '%s' to host address\n", hostname);
-    return False;
+  if (IsUnixHost(hostname)) {
+    rfbsock = ConnectToUnixAddr(hostname + strlen(UNIX_HOST_PREFIX));
+    if (rfbsock < 0) {
+      fprintf(stderr,"Unable to connect to VNC server\n");
+      return False;
+    }
+    return True;
   }
 
-  rfbsock = ConnectToTcpAddr(host, port);
+  rfbsock = ConnectToTcpHost(hostname, port);
 
   if (rfbsock < 0) {
     fprintf(stderr,"Unable to connect to VNC server\n");
@@ -277,6 +312,10 @@ InitialiseRFBConnection(void)
     if (!AuthenticateVNC())
       return False;
     break;
+  case rfbSecTypeVeNCrypt:
+    if (!AuthenticateVeNCrypt())
+      return False;
+    break;
   case rfbSecTypeTight:
     tightVncProtocol = True;
     InitCapabilities();
@@ -328,6 +367,53 @@ InitialiseRFBConnection(void)
       return False;
   }
 
+  if (appData.scale && !SetServerScale())
+    return False;
+
+  return True;
+}
+
+
+/*
+ * SetServerScale asks the server to shrink its desktop before sending it,
+ * for -scale, so that a desktop bigger than the device costs no more than
+ * the pixels we can show.  With "auto" the factor is the smallest which
+ * fits the desktop in the device's mode.  From now on si has the scaled
+ * size, which is what the server's updates will fit.
+ */
+
+static Bool
+SetServerScale(void)
+{
+  rfbSetScaleMsg ss;
+  int f;
+
+  if (!scaleFactor) {
+    scaleFactor = appData.scale;
+    if (scaleFactor < 0) {
+      scaleFactor = (si.framebufferWidth + deviceWidth - 1) / deviceWidth;
+      f = (si.framebufferHeight + deviceHeight - 1) / deviceHeight;
+      if (f > scaleFactor)
+        scaleFactor = f;
+      if (scaleFactor > 255)
+        scaleFactor = 255;
+    }
+    if (scaleFactor > 1)
+      fprintf(stderr,"Asking the server to scale its %dx%d desktop by 1/%d\n",
+              si.framebufferWidth, si.framebufferHeight, scaleFactor);
+  }
+
+  if (scaleFactor <= 1)
+    return True;
+
+  ss.type = rfbSetScale;
+  ss.scale = scaleFactor;
+  ss.pad = 0;
+  if (!QueueRFBMessage((char *)&ss, sz_rfbSetScaleMsg))
+    return False;
+
+  si.framebufferWidth /= scaleFactor;
+  si.framebufferHeight /= scaleFactor;
   return True;
 }
 
@@ -358,6 +444,13 @@ ReadSecurityType(void)
     return rfbSecTypeInvalid;
   }
 
+  /* Protocol 3.3 has no VeNCrypt, so a server answering as 3.3 can't
+     prove who it is. */
+  if (appData.x509CA) {
+    fprintf(stderr, "Server did not offer VeNCrypt, which -x509ca requires\n");
+    return rfbSecTypeInvalid;
+  }
+
   return (int)secType;
 }
 
@@ -390,6 +483,25 @@ SelectSecurityType(void)
   if (!ReadFromRFBServer((char *)secTypes, nSecTypes))
     return rfbSecTypeInvalid;
 
+  /* Prefer an encrypted session if the server offers one */
+  for (j = 0; j < (int)nSecTypes && !appData.noTLS; j++) {
+    if (secTypes[j] == rfbSecTypeVeNCrypt) {
+      free(secTypes);
+      secType = rfbSecTypeVeNCrypt;
+      if (!WriteExact(rfbsock, (char *)&secType, sizeof(secType)))
+        return rfbSecTypeInvalid;
+      return rfbSecTypeVeNCrypt;
+    }
+  }
+
+  /* With -x509ca, don't fall back to an unencrypted session; someone in
+     the middle could have removed VeNCrypt from the list. */
+  if (appData.x509CA) {
+    free(secTypes);
+    fprintf(stderr, "Server did not offer VeNCrypt, which -x509ca requires\n");
+    return rfbSecTypeInvalid;
+  }
+
   /* Find out if the server supports TightVNC protocol extensions */
   for (j = 0; j < (int)nSecTypes; j++) {
     if (secTypes[j] == rfbSecTypeTight) {
@@ -510,6 +622,100 @@ PerformAuthenticationTight(void)
 }
 
 
+/*
+ * VeNCrypt: agree a TLS sub-type, start TLS, then carry out the inner
+ * authentication over the encrypted connection.  Sub-types with a server
+ * certificate are preferred over anonymous ones.  With -x509ca only those are
+ * accepted: the list of sub-types isn't protected, so anyone in the middle
+ * could otherwise offer just the anonymous ones to avoid the check.  The
+ * Plain (username and password) sub-types are not supported.
+ */
+
+static Bool
+AuthenticateVeNCrypt(void)
+{
+  static CARD32 preferred[] = {
+    rfbVeNCryptX509Vnc, rfbVeNCryptX509None,
+    rfbVeNCryptTLSVnc, rfbVeNCryptTLSNone
+  };
+  CARD8 version[2], status, nSubTypes;
+  CARD32 subTypes[255], chosen = 0;
+  int nPreferred = sizeof(preferred) / sizeof(preferred[0]);
+  char *p;
+  int i, j;
+
+  if (appData.x509CA)
+    nPreferred = 2;
+
+  if (!ReadFromRFBServer((char *)version, 2))
+    return False;
+  if (version[0] != 0 || version[1] < 2) {
+    fprintf(stderr, "Unsupported VeNCrypt version %d.%d\n",
+            version[0], version[1]);
+    return False;
+  }
+  version[1] = 2;
+  if (!WriteExact(rfbsock, (char *)version, 2))
+    return False;
+  if (!ReadFromRFBServer((char *)&status, 1))
+    return False;
+  if (status != 0) {
+    fprintf(stderr, "Server refused VeNCrypt version 0.2\n");
+    return False;
+  }
+
+  if (!ReadFromRFBServer((char *)&nSubTypes, 1))
+    return False;
+  if (nSubTypes == 0) {
+    fprintf(stderr, "Server offered no VeNCrypt sub-types\n");
+    return False;
+  }
+  if ((p = PeekFromRFBServer(nSubTypes * 4)) == NULL)
+    return False;
+  for (j = 0; j < nSubTypes; j++)
+    subTypes[j] = RD_CARD32(p + j * 4);
+  ConsumeFromRFBServer(nSubTypes * 4);
+
+  for (i = 0; i < nPreferred && !chosen; i++) {
+    for (j = 0; j < nSubTypes; j++) {
+      if (subTypes[j] == preferred[i]) {
+        chosen = preferred[i];
+        break;
+      }
+    }
+  }
+  if (!chosen) {
+    if (appData.x509CA)
+      fprintf(stderr, "Server did not offer a VeNCrypt sub-type with a "
+              "certificate, which -x509ca requires\n");
+    else
+      fprintf(stderr, "Server did not offer a supported VeNCrypt sub-type\n");
+    return False;
+  }
+
+  chosen = Swap32IfLE(chosen);
+  if (!WriteExact(rfbsock, (char *)&chosen, 4))
+    return False;
+  chosen = Swap32IfLE(chosen);
+
+  if (!ReadFromRFBServer((char *)&status, 1))
+    return False;
+  if (status != 1) {
+    fprintf(stderr, "Server rejected VeNCrypt sub-type %lu\n",
+            (unsigned long)chosen);
+    return False;
+  }
+
+  if (!StartTLS(rfbsock, chosen == rfbVeNCryptTLSVnc ||
+                         chosen == rfbVeNCryptTLSNone))
+    return False;
+
+  if (chosen == rfbVeNCryptX509Vnc || chosen == rfbVeNCryptTLSVnc)
+    return AuthenticateVNC();
+  return AuthenticateNone();
+}
+
+
 /*
  * Null authentication.
  */
@@ -529,9 +735,12 @@ AuthenticateNone(void)
 
 
 /*
- * Standard VNC authentication.
+ * Standard VNC authentication.  With -stripes, the password the main
+ * connection was given is kept for the others, which connect later.
  */
 
+static char stripePasswd[9];
+
 static Bool
 AuthenticateVNC(void)
 {
@@ -547,7 +756,9 @@ AuthenticateVNC(void)
   if (!ReadFromRFBServer((char *)challenge, CHALLENGESIZE))
     return False;
 
-  if (appData.passwordFile) {
+  if (stripeIndex > 0) {
+    passwd = strcpy(buffer, stripePasswd);
+  } else if (appData.passwordFile) {
     passwd = vncDecryptPasswdFromFile(appData.passwordFile);
     if (!passwd) {
       fprintf(stderr, "Cannot read valid password from file \"%s\"\n",
@@ -576,6 +787,8 @@ AuthenticateVNC(void)
   if (strlen(passwd) > 8) {
     passwd[8] = '\0';
   }
+  if (appData.stripes > 1 && stripeIndex == 0)
+    strcpy(stripePasswd, passwd);
 
   vncEncryptBytes(challenge, passwd);
 
@@ -680,13 +893,6 @@ Bool
 SetFormatAndEncodings()
 {
     rfbSetPixelFormatMsg spf;
-    char buf[sz_rfbSetEncodingsMsg + MAX_ENCODINGS * 4];
-    rfbSetEncodingsMsg *se = (rfbSetEncodingsMsg *)buf;
-    CARD32 *encs = (CARD32 *)(&buf[sz_rfbSetEncodingsMsg]);
-    int len = 0;
-    Bool requestCompressLevel = False;
-    Bool requestQualityLevel = False;
-    Bool requestLastRectEncoding = False;
 
     spf.type = rfbSetPixelFormat;
     spf.format = myFormat;
@@ -696,13 +902,61 @@ SetFormatAndEncodings()
     spf.format.greenMax = Swap16IfLE(spf.format.greenMax);
     spf.format.blueMax = Swap16IfLE(spf.format.blueMax);
 
-    if (!WriteExact(rfbsock, (char *)&spf, sz_rfbSetPixelFormatMsg))
+    if (!QueueRFBMessage((char *)&spf, sz_rfbSetPixelFormatMsg))
         return False;
     printf("Setting pixel format done\n");
 
+    return SendEncodings();
+}
+
+
+/*
+ * appData.encodingsString can be replaced from the control socket while a
+ * stripe's thread is reading it; see SetEncodingsString().
+ */
+
+static pthread_mutex_t encodingsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * SetEncodingsString replaces the -encodings list, or removes it if list is
+ * NULL.
+ */
+
+void
+SetEncodingsString(const char *list)
+{
+  char *copy = list ? strdup(list) : NULL;
+  char *old;
+
+  pthread_mutex_lock(&encodingsMutex);
+  old = appData.encodingsString;
+  appData.encodingsString = copy;
+  pthread_mutex_unlock(&encodingsMutex);
+  free(old);
+}
+
+
+/*
+ * SendEncodings.  Without -encodings, the list comes from autoselect.c if
+ * that is in use, and this is sent again whenever it changes its mind.
+ */
+
+Bool
+SendEncodings(void)
+{
+    char buf[sz_rfbSetEncodingsMsg + MAX_ENCODINGS * 4];
+    rfbSetEncodingsMsg *se = (rfbSetEncodingsMsg *)buf;
+    CARD32 *encs = (CARD32 *)(&buf[sz_rfbSetEncodingsMsg]);
+    int len = 0;
+    Bool requestCompressLevel = False;
+    Bool requestQualityLevel = False;
+
     se->type = rfbSetEncodings;
     se->nEncodings = 0;
 
+    pthread_mutex_lock(&encodingsMutex);
+
     if (appData.encodingsString) {
         char *encStr = appData.encodingsString;
         int encStrLen;
@@ -721,7 +975,6 @@ SetFormatAndEncodings()
                 encs[se->nEncodings++]  = Swap32IfLE(rfbEncodingCopyRect);
             } else if (strncasecmp(encStr,"tight",encStrLen) == 0) {
                 encs[se->nEncodings++]  = Swap32IfLE(rfbEncodingTight);
-                requestLastRectEncoding = True;
                 if (appData.compressLevel >= 0 && appData.compressLevel <= 9)
                   requestCompressLevel = True;
                 if (appData.enableJPEG)
@@ -754,20 +1007,12 @@ SetFormatAndEncodings()
           encs[se->nEncodings++] = Swap32IfLE(appData.qualityLevel +
                                               rfbEncodingQualityLevel0);
         }
-
-        // if (appData.useRemoteCursor) {
-        //      if (se->nEncodings < MAX_ENCODINGS)
-        //        encs[se->nEncodings++] = Swap32IfLE(rfbEncodingXCursor);
-        //      if (se->nEncodings < MAX_ENCODINGS)
-        //        encs[se->nEncodings++] = Swap32IfLE(rfbEncodingRichCursor);
-        //      if (se->nEncodings < MAX_ENCODINGS)
-        //        encs[se->nEncodings++] = Swap32IfLE(rfbEncodingPointerPos);
-        //    }
-
-        if (se->nEncodings < MAX_ENCODINGS && requestLastRectEncoding) {
-          encs[se->nEncodings++] = Swap32IfLE(rfbEncodingLastRect);
-        }
   
+  } else if (autoSelect) {
+
+    /* Leave room for the pseudo-encodings added below. */
+    se->nEncodings = AutoSelectEncodings(encs, MAX_ENCODINGS - 8);
+
   } else {
     
     if (SameMachine(rfbsock)) {
@@ -780,22 +1025,22 @@ SetFormatAndEncodings()
     }
 
     encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCopyRect);
-    // encs[se->nEncodings++] = Swap32IfLE(rfbEncodingTight);
-    // encs[se->nEncodings++] = Swap32IfLE(rfbEncodingHextile);
-    // encs[se->nEncodings++] = Swap32IfLE(rfbEncodingZlib);
-    // encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCoRRE);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingTight);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingHextile);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingZlib);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCoRRE);
     encs[se->nEncodings++] = Swap32IfLE(rfbEncodingRRE);
 
-    // if (appData.compressLevel >= 0 && appData.compressLevel <= 9) {
-    //       encs[se->nEncodings++] = Swap32IfLE(appData.compressLevel +
-    //                                           rfbEncodingCompressLevel0);
-    //     } else if (!tunnelSpecified) {
-    //       /* If -tunnel option was provided, we assume that server machine is
-    //          not in the local network so we use default compression level for
-    //          tight encoding instead of fast compression. Thus we are
-    //          requesting level 1 compression only if tunneling is not used. */
-    //       encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCompressLevel1);
-    //     }
+    if (appData.compressLevel >= 0 && appData.compressLevel <= 9) {
+      encs[se->nEncodings++] = Swap32IfLE(appData.compressLevel +
+                                          rfbEncodingCompressLevel0);
+    } else if (!tunnelSpecified) {
+      /* If -tunnel option was provided, we assume that server machine is
+         not in the local network so we use default compression level for
+         tight encoding instead of fast compression. Thus we are
+         requesting level 1 compression only if tunneling is not used. */
+      encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCompressLevel1);
+    }
     
     if (appData.enableJPEG) {
        if (appData.qualityLevel < 0 || appData.qualityLevel > 9)
@@ -803,35 +1048,239 @@ SetFormatAndEncodings()
        encs[se->nEncodings++] = Swap32IfLE(appData.qualityLevel +
                                                rfbEncodingQualityLevel0);
     }
-     
-       // if (appData.useRemoteCursor) {
-       //            encs[se->nEncodings++] = Swap32IfLE(rfbEncodingXCursor);
-       //            encs[se->nEncodings++] = Swap32IfLE(rfbEncodingRichCursor);
-       //            encs[se->nEncodings++] = Swap32IfLE(rfbEncodingPointerPos);
-       //        }
   }
+
+  pthread_mutex_unlock(&encodingsMutex);
     
-  encs[se->nEncodings++] = Swap32IfLE(rfbEncodingLastRect);
+  if (se->nEncodings + 3 <= MAX_ENCODINGS) {
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingExtendedDesktopSize);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingNewFBSize);
+  }
+
+  if (appData.useRemoteCursor && se->nEncodings + 4 <= MAX_ENCODINGS) {
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingXCursor);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingRichCursor);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingPointerPos);
+  } else if (appData.followPointer && stripeIndex == 0 &&
+             se->nEncodings + 2 <= MAX_ENCODINGS) {
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingPointerPos);
+  }
+
+  if (!appData.noContinuous && se->nEncodings + 3 <= MAX_ENCODINGS) {
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingFence);
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingContinuousUpdates);
+  }
+
+  /* LastRect goes last, whatever the list. */
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = Swap32IfLE(rfbEncodingLastRect);
+
+  /* Servers only use JPEG when they are given a quality level. */
+  if (lossless) {
+    int i, n = 0;
+    CARD32 e;
+
+    for (i = 0; i < se->nEncodings; i++) {
+      e = Swap32IfLE(encs[i]);
+      if (e < rfbEncodingQualityLevel0 || e > rfbEncodingQualityLevel9)
+        encs[n++] = encs[i];
+    }
+    se->nEncodings = n;
+  }
 
   len = sz_rfbSetEncodingsMsg + se->nEncodings * 4;
 
   se->nEncodings = Swap16IfLE(se->nEncodings);
 
-  if (!WriteExact(rfbsock, buf, len)) return False;
+  if (!QueueRFBMessage(buf, len)) return False;
 
   return True;
 }
 
 
 /*
- * SendIncrementalFramebufferUpdateRequest.
+ * SetLossless stops the server using JPEG while refine.c fetches exact
+ * copies of lossy areas, and lets it use JPEG again afterwards.
+ */
+
+Bool
+SetLossless(Bool enable)
+{
+  if (enable == lossless)
+    return True;
+  lossless = enable;
+  return SendEncodings();
+}
+
+
+/*
+ * SendIncrementalFramebufferUpdateRequest asks for the viewport, or with
+ * -stripes for this connection's band of it.
  */
 
 Bool
 SendIncrementalFramebufferUpdateRequest()
 {
-  return SendFramebufferUpdateRequest(0, 0, si.framebufferWidth,
-                                      si.framebufferHeight, True);
+  int x, y, w, h;
+
+  GetStripeBand(&x, &y, &w, &h);
+  return SendFramebufferUpdateRequest(x, y, w, h, True);
+}
+
+
+/*
+ * RequestExposed asks for the parts of the viewport outside the given
+ * rectangle, which is inside the viewport and still correct on the device.
+ * If the rectangle is empty the whole viewport is requested.
+ */
+
+static Bool
+RequestExposed(int x, int y, int w, int h)
+{
+  int right = viewportX + viewportWidth;
+  int bottom = viewportY + viewportHeight;
+
+  if (w <= 0 || h <= 0)
+    return SendFramebufferUpdateRequest(viewportX, viewportY, viewportWidth,
+                                        viewportHeight, False);
+
+  if (y > viewportY &&
+      !SendFramebufferUpdateRequest(viewportX, viewportY, viewportWidth,
+                                    y - viewportY, False))
+    return False;
+  if (y + h < bottom &&
+      !SendFramebufferUpdateRequest(viewportX, y + h, viewportWidth,
+                                    bottom - y - h, False))
+    return False;
+  if (x > viewportX &&
+      !SendFramebufferUpdateRequest(viewportX, y, x - viewportX, h, False))
+    return False;
+  if (x + w < right &&
+      !SendFramebufferUpdateRequest(x + w, y, right - x - w, h, False))
+    return False;
+
+  return True;
+}
+
+
+/*
+ * PanViewport moves the viewport to show the desktop from (x, y), or as near
+ * as it will go.  What stays in view is moved across on the device, and only
+ * the newly exposed strips are requested from the server.
+ */
+
+Bool
+PanViewport(int x, int y)
+{
+  int dx, dy;
+
+  if (x > si.framebufferWidth - viewportWidth)
+    x = si.framebufferWidth - viewportWidth;
+  if (y > si.framebufferHeight - viewportHeight)
+    y = si.framebufferHeight - viewportHeight;
+  if (x < 0)
+    x = 0;
+  if (y < 0)
+    y = 0;
+
+  dx = x - viewportX;
+  dy = y - viewportY;
+  if (dx == 0 && dy == 0)
+    return True;
+
+  /* The cursor mustn't be moved with the rest of the screen. */
+  LockDevice();
+  SoftCursorLockArea(viewportX, viewportY, viewportWidth, viewportHeight);
+  MoveViewport(x, y);
+  SoftCursorUnlockScreen();
+  UnlockDevice();
+
+  if (!RequestExposed(dx > 0 ? x : x - dx, dy > 0 ? y : y - dy,
+                      viewportWidth - abs(dx), viewportHeight - abs(dy)))
+    return False;
+
+  if (continuousUpdates && !continuousPaused)
+    return SendEnableContinuousUpdates(True, viewportX, viewportY,
+                                       viewportWidth, viewportHeight);
+  return True;
+}
+
+
+/*
+ * ResizeDesktop deals with the server's desktop changing size.  The device
+ * mode and the viewport are fitted to the new size, and only the parts of
+ * the viewport the device isn't already showing are requested.
+ */
+
+static Bool
+ResizeDesktop(int w, int h)
+{
+  int x = viewportX, y = viewportY;
+  int keepW = viewportWidth, keepH = viewportHeight;
+
+  if (w == si.framebufferWidth && h == si.framebufferHeight)
+    return True;
+  if (w == 0 || h == 0) {
+    fprintf(stderr,"Ignoring resize to %dx%d\n", w, h);
+    return True;
+  }
+
+  si.framebufferWidth = w;
+  si.framebufferHeight = h;
+
+  /* The main connection looks after the device. */
+  if (stripeIndex > 0)
+    return True;
+
+  fprintf(stderr,"Desktop resized to %dx%d\n", w, h);
+
+  LockDevice();
+  SoftCursorLockArea(viewportX, viewportY, viewportWidth, viewportHeight);
+
+  if (SelectDeviceMode(w, h)) {
+    /* The device has been cleared. */
+    InitViewport(w, h, x, y);
+    keepW = 0;
+  } else {
+    ResizeViewport(w, h);
+    if (!ClipToViewport(&x, &y, &keepW, &keepH))
+      keepW = 0;
+  }
+
+  SoftCursorUnlockScreen();
+  UnlockDevice();
+
+  if (!RequestExposed(x, y, keepW, keepH))
+    return False;
+
+  if (continuousUpdates && !continuousPaused)
+    return SendEnableContinuousUpdates(True, viewportX, viewportY,
+                                       viewportWidth, viewportHeight);
+  return True;
+}
+
+
+/*
+ * With -follow, the server tells us where its pointer is.  When it comes
+ * within FOLLOW_MARGIN pixels of the edge of the viewport, recentre the
+ * viewport on it.
+ */
+
+#define FOLLOW_MARGIN 32
+
+static Bool
+FollowPointer(int px, int py)
+{
+  int x = viewportX, y = viewportY;
+
+  if (px < viewportX + FOLLOW_MARGIN ||
+      px >= viewportX + viewportWidth - FOLLOW_MARGIN)
+    x = px - viewportWidth / 2;
+  if (py < viewportY + FOLLOW_MARGIN ||
+      py >= viewportY + viewportHeight - FOLLOW_MARGIN)
+    y = py - viewportHeight / 2;
+
+  return PanViewport(x, y);
 }
 
 
@@ -851,13 +1300,75 @@ SendFramebufferUpdateRequest(int x, int y, int w, int h, Bool incremental)
   fur.w = Swap16IfLE(w);
   fur.h = Swap16IfLE(h);
 
-  if (!WriteExact(rfbsock, (char *)&fur, sz_rfbFramebufferUpdateRequestMsg))
+  if (!QueueRFBMessage((char *)&fur, sz_rfbFramebufferUpdateRequestMsg))
     return False;
 
   return True;
 }
 
 
+/*
+ * SendEnableContinuousUpdates.
+ */
+
+Bool
+SendEnableContinuousUpdates(Bool enable, int x, int y, int w, int h)
+{
+  rfbEnableContinuousUpdatesMsg ecu;
+
+  ecu.type = rfbEnableContinuousUpdates;
+  ecu.enable = enable ? 1 : 0;
+  ecu.x = Swap16IfLE(x);
+  ecu.y = Swap16IfLE(y);
+  ecu.w = Swap16IfLE(w);
+  ecu.h = Swap16IfLE(h);
+
+  return QueueRFBMessage((char *)&ecu, sz_rfbEnableContinuousUpdatesMsg);
+}
+
+
+/*
+ * ProbeRoundTrip sends a fence to measure the round trip time, if the server
+ * understands them and we don't already have one on its way.  Besides
+ * fenceMinRtt, this keeps the kernel's own estimate (see RFBRoundTripMs)
+ * fresh when we would otherwise send nothing.
+ */
+
+Bool
+ProbeRoundTrip(void)
+{
+  if (!serverHasFence || fencePending)
+    return True;
+  return SendFlowFence();
+}
+
+
+/*
+ * SendFence.  The message is built byte by byte because rfbFenceMsg is not a
+ * multiple of 4 bytes long.
+ */
+
+Bool
+SendFence(CARD32 flags, int len, char *data)
+{
+  char buf[sz_rfbFenceMsg + rfbFenceMaxPayload];
+
+  if (len > rfbFenceMaxPayload)
+    len = rfbFenceMaxPayload;
+
+  buf[0] = rfbClientFence;
+  buf[1] = buf[2] = buf[3] = 0;
+  buf[4] = (flags >> 24) & 0xff;
+  buf[5] = (flags >> 16) & 0xff;
+  buf[6] = (flags >> 8) & 0xff;
+  buf[7] = flags & 0xff;
+  buf[8] = len;
+  memcpy(buf + sz_rfbFenceMsg, data, len);
+
+  return QueueRFBMessage(buf, sz_rfbFenceMsg + len);
+}
+
+
 /*
  * SendPointerEvent.
  */
@@ -874,7 +1385,7 @@ SendPointerEvent(int x, int y, int buttonMask)
 
   pe.x = Swap16IfLE(x);
   pe.y = Swap16IfLE(y);
-  return WriteExact(rfbsock, (char *)&pe, sz_rfbPointerEventMsg);
+  return QueueRFBMessage((char *)&pe, sz_rfbPointerEventMsg);
 }
 
 
@@ -890,7 +1401,7 @@ SendKeyEvent(CARD32 key, Bool down)
   ke.type = rfbKeyEvent;
   ke.down = down ? 1 : 0;
   ke.key = Swap32IfLE(key);
-  return WriteExact(rfbsock, (char *)&ke, sz_rfbKeyEventMsg);
+  return QueueRFBMessage((char *)&ke, sz_rfbKeyEventMsg);
 }
 
 
@@ -909,8 +1420,8 @@ SendClientCutText(char *str, int len)
 
   cct.type = rfbClientCutText;
   cct.length = Swap32IfLE(len);
-  return  (WriteExact(rfbsock, (char *)&cct, sz_rfbClientCutTextMsg) &&
-           WriteExact(rfbsock, str, len));
+  return  (QueueRFBMessage((char *)&cct, sz_rfbClientCutTextMsg) &&
+           QueueRFBData(str, len));
 }
 
 
@@ -922,9 +1433,12 @@ Bool
 HandleRFBServerMessage()
 {
   rfbServerToClientMsg msg;
+  char *p;
 
-  if (!ReadFromRFBServer((char *)&msg, 1))
+  if ((p = PeekFromRFBServer(1)) == NULL)
     return False;
+  msg.type = RD_CARD8(p);
+  ConsumeFromRFBServer(1);
 
   switch (msg.type) {
 
@@ -962,41 +1476,69 @@ HandleRFBServerMessage()
     int i;
     int usecs;
 
-    if (!ReadFromRFBServer(((char *)&msg.fu) + 1,
-                           sz_rfbFramebufferUpdateMsg - 1))
+    /* The update and rectangle headers are parsed in place. */
+    if ((p = PeekFromRFBServer(sz_rfbFramebufferUpdateMsg - 1)) == NULL)
       return False;
+    msg.fu.nRects = RD_CARD16(p + 1);
+    ConsumeFromRFBServer(sz_rfbFramebufferUpdateMsg - 1);
 
-    msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
+    AutoSelectUpdateStart();
 
     for (i = 0; i < msg.fu.nRects; i++) {
-      if (!ReadFromRFBServer((char *)&rect, sz_rfbFramebufferUpdateRectHeader))
+      if ((p = PeekFromRFBServer(sz_rfbFramebufferUpdateRectHeader)) == NULL)
         return False;
 
-      rect.encoding = Swap32IfLE(rect.encoding);
+      rect.encoding = RD_CARD32(p + sz_rfbRectangle);
+      rect.r.x = RD_CARD16(p);
+      rect.r.y = RD_CARD16(p + 2);
+      rect.r.w = RD_CARD16(p + 4);
+      rect.r.h = RD_CARD16(p + 6);
+      ConsumeFromRFBServer(sz_rfbFramebufferUpdateRectHeader);
+
       if (rect.encoding == rfbEncodingLastRect)
         break;
 
-      rect.r.x = Swap16IfLE(rect.r.x);
-      rect.r.y = Swap16IfLE(rect.r.y);
-      rect.r.w = Swap16IfLE(rect.r.w);
-      rect.r.h = Swap16IfLE(rect.r.h);
-
-      // if (rect.encoding == rfbEncodingXCursor ||
-      //           rect.encoding == rfbEncodingRichCursor) {
-      //         if (!HandleCursorShape(rect.r.x, rect.r.y, rect.r.w, rect.r.h,
-      //                               rect.encoding)) {
-      //           return False;
-      //         }
-      //         continue;
-      //       }
-      // 
-      //       if (rect.encoding == rfbEncodingPointerPos) {
-      //         if (!HandleCursorPos(rect.r.x, rect.r.y)) {
-      //           return False;
-      //         }
-      //         continue;
-      //       }
-      
+      if (rect.encoding == rfbEncodingXCursor ||
+          rect.encoding == rfbEncodingRichCursor) {
+        if (!HandleCursorShape(rect.r.x, rect.r.y, rect.r.w, rect.r.h,
+                               rect.encoding)) {
+          return False;
+        }
+        continue;
+      }
+
+      if (rect.encoding == rfbEncodingNewFBSize) {
+        if (!ResizeDesktop(rect.r.w, rect.r.h))
+          return False;
+        continue;
+      }
+
+      if (rect.encoding == rfbEncodingExtendedDesktopSize) {
+        int nScreens;
+
+        if ((p = PeekFromRFBServer(sz_rfbExtDesktopSizeHeader)) == NULL)
+          return False;
+        nScreens = RD_CARD8(p);
+        ConsumeFromRFBServer(sz_rfbExtDesktopSizeHeader);
+
+        /* We show the desktop as a whole, so the screen layout doesn't
+           matter to us. */
+        if (!ReadFromRFBServer(buffer, nScreens * sz_rfbScreenDesc))
+          return False;
+
+        /* A non-zero status is a refused request, and nothing changed. */
+        if (rect.r.y == 0 && !ResizeDesktop(rect.r.w, rect.r.h))
+          return False;
+        continue;
+      }
+
+      if (rect.encoding == rfbEncodingPointerPos) {
+        SoftCursorMove(rect.r.x, rect.r.y);
+        if (appData.followPointer && !FollowPointer(rect.r.x, rect.r.y))
+          return False;
+        continue;
+      }
+
       if ((rect.r.x + rect.r.w > si.framebufferWidth) ||
           (rect.r.y + rect.r.h > si.framebufferHeight))
         {
@@ -1012,7 +1554,11 @@ HandleRFBServerMessage()
 
       /* If RichCursor encoding is used, we should prevent collisions
          between framebuffer updates and cursor drawing operations. */
-      // SoftCursorLockArea(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      SoftCursorLockArea(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+
+      if (rect.encoding != rfbEncodingCopyRect)
+        RefineCovered(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      ScheduleChanged(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
 
       switch (rect.encoding) {
 
@@ -1037,22 +1583,49 @@ HandleRFBServerMessage()
         case rfbEncodingCopyRect:
         {
             rfbCopyRect cr;
-            if (!ReadFromRFBServer((char *)&cr, sz_rfbCopyRect))
+            if ((p = PeekFromRFBServer(sz_rfbCopyRect)) == NULL)
                 return False;
 
-            cr.srcX = Swap16IfLE(cr.srcX);
-            cr.srcY = Swap16IfLE(cr.srcY);
+            cr.srcX = RD_CARD16(p);
+            cr.srcY = RD_CARD16(p + 2);
+            ConsumeFromRFBServer(sz_rfbCopyRect);
 
-            //           /* If RichCursor encoding is used, we should extend our
-            // "cursor lock area" (previously set to destination
-            //     rectangle) to the source rectangle as well. */
-            //     SoftCursorLockArea(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
+            /* If RichCursor encoding is used, we should extend our
+               "cursor lock area" (previously set to destination
+               rectangle) to the source rectangle as well. */
+            SoftCursorLockArea(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
+            RefineCopied(cr.srcX, cr.srcY, rect.r.w, rect.r.h,
+                         rect.r.x, rect.r.y);
 
             if (appData.copyRectDelay != 0) {
                             /* Draw area, delay */
             }
 
-           CopyRect(cr.srcX, cr.srcY, rect.r.w, rect.r.h, rect.r.x, rect.r.y);
+            /* The device only has what's in the viewport.  If part of the
+               source is outside it, ask for the destination instead.  With
+               -stripes, other bands come from other connections and may be
+               ahead of or behind this one, so the source must be in our
+               band too. */
+            LockDevice();
+            {
+              int x = rect.r.x, y = rect.r.y, w = rect.r.w, h = rect.r.h;
+              int sx, sy, sw, sh;
+
+              if (ClipToViewport(&x, &y, &w, &h)) {
+                sx = cr.srcX + x - rect.r.x;
+                sy = cr.srcY + y - rect.r.y;
+                sw = w;
+                sh = h;
+                if (ClipToViewport(&sx, &sy, &sw, &sh) && sw == w && sh == h &&
+                    InStripeBand(sx, sy, w, h)) {
+                  CopyRect(sx, sy, w, h, x, y);
+                } else if (!SendFramebufferUpdateRequest(x, y, w, h, False)) {
+                  UnlockDevice();
+                  return False;
+                }
+              }
+            }
+            UnlockDevice();
 
             break;
         }
@@ -1076,81 +1649,81 @@ HandleRFBServerMessage()
               break;
       }
 
-      // case rfbEncodingCoRRE:
-      //       {
-      //           switch (myFormat.bitsPerPixel) {
-      //           case 8:
-      //               if (!HandleCoRRE8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //                   return False;
-      //               break;
-      //           case 16:
-      //               if (!HandleCoRRE16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //                   return False;
-      //               break;
-      //           case 32:
-      //               if (!HandleCoRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //                   return False;
-      //               break;
-      //       }
-      //         break;
-      //       }
-      // 
-      //       case rfbEncodingHextile:
-      //       {
-      //         switch (myFormat.bitsPerPixel) {
-      //         case 8:
-      //           if (!HandleHextile8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 16:
-      //           if (!HandleHextile16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 32:
-      //           if (!HandleHextile32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         }
-      //         break;
-      //       }
-      // 
-      //       case rfbEncodingZlib:
-      //       {
-      //         switch (myFormat.bitsPerPixel) {
-      //         case 8:
-      //           if (!HandleZlib8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 16:
-      //           if (!HandleZlib16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 32:
-      //           if (!HandleZlib32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         }
-      //         break;
-      //      }
-      // 
-      //       case rfbEncodingTight:
-      //       {
-      //         switch (myFormat.bitsPerPixel) {
-      //         case 8:
-      //           if (!HandleTight8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 16:
-      //           if (!HandleTight16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         case 32:
-      //           if (!HandleTight32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-      //             return False;
-      //           break;
-      //         }
-      //         break;
-      //       }
+      case rfbEncodingCoRRE:
+      {
+          switch (myFormat.bitsPerPixel) {
+          case 8:
+              if (!HandleCoRRE8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+                  return False;
+              break;
+          case 16:
+              if (!HandleCoRRE16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+                  return False;
+              break;
+          case 32:
+              if (!HandleCoRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+                  return False;
+              break;
+          }
+          break;
+      }
+
+      case rfbEncodingHextile:
+      {
+        switch (myFormat.bitsPerPixel) {
+        case 8:
+          if (!HandleHextile8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 16:
+          if (!HandleHextile16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 32:
+          if (!HandleHextile32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        }
+        break;
+      }
+
+      case rfbEncodingZlib:
+      {
+        switch (myFormat.bitsPerPixel) {
+        case 8:
+          if (!HandleZlib8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 16:
+          if (!HandleZlib16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 32:
+          if (!HandleZlib32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        }
+        break;
+      }
+
+      case rfbEncodingTight:
+      {
+        switch (myFormat.bitsPerPixel) {
+        case 8:
+          if (!HandleTight8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 16:
+          if (!HandleTight16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        case 32:
+          if (!HandleTight32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+            return False;
+          break;
+        }
+        break;
+      }
 
       default:
         fprintf(stderr,"Unknown rect encoding %d\n",
@@ -1160,8 +1733,22 @@ HandleRFBServerMessage()
 
     }
 
-    if (!SendIncrementalFramebufferUpdateRequest())
-      return False;
+    SoftCursorUnlockScreen();
+    AutoSelectUpdateEnd();
+
+    /* With continuous updates the server sends the next update when it has
+       one; all we do is keep a fence going to watch for a backlog.  With
+       -region or -rate, schedule.c sends the requests. */
+
+    if (scheduling) {
+      ScheduleUpdateDone();
+    } else if (!continuousUpdates) {
+      if (!RequestNextUpdate())
+        return False;
+    } else if (!fencePending) {
+      if (!SendFlowFence())
+        return False;
+    }
 
     break;
   }
@@ -1195,6 +1782,20 @@ HandleRFBServerMessage()
     break;
   }
 
+  case rfbEndOfContinuousUpdates:
+  {
+    if (!HandleEndOfContinuousUpdates())
+      return False;
+    break;
+  }
+
+  case rfbServerFence:
+  {
+    if (!HandleFence())
+      return False;
+    break;
+  }
+
   default:
     fprintf(stderr,"Unknown message type %d from VNC server\n",msg.type);
     return False;
@@ -1204,6 +1805,234 @@ HandleRFBServerMessage()
 }
 
 
+/*
+ * Once the server has shown that it understands both fences and continuous
+ * updates, ask it to stream updates for the whole screen.  Without fences we
+ * would have no way to tell when we are falling behind, so stay with
+ * requesting each update.
+ */
+
+static Bool
+StartContinuousUpdates(void)
+{
+  if (continuousUpdates || !serverHasFence || !serverHasContinuous)
+    return True;
+
+  fprintf(stderr,"Using continuous updates\n");
+  continuousUpdates = True;
+  continuousPaused = False;
+  return SendEnableContinuousUpdates(True, viewportX, viewportY,
+                                     viewportWidth, viewportHeight);
+}
+
+
+/*
+ * HandleEndOfContinuousUpdates.  The first one tells us that the server
+ * supports continuous updates.  After that we get one each time we pause
+ * them; if we didn't ask, the server has stopped streaming on its own, so go
+ * back to requesting updates.
+ */
+
+static Bool
+HandleEndOfContinuousUpdates(void)
+{
+  if (!serverHasContinuous) {
+    serverHasContinuous = True;
+    return StartContinuousUpdates();
+  }
+
+  if (continuousUpdates && !continuousPaused) {
+    fprintf(stderr,"Server ended continuous updates\n");
+    continuousUpdates = False;
+    return SendIncrementalFramebufferUpdateRequest();
+  }
+
+  return True;
+}
+
+
+/*
+ * PacedRequest runs on a timer set by RequestNextUpdate.
+ */
+
+static void
+PacedRequest(void *data)
+{
+  paceTimer = 0;
+  if (!RequestNextUpdate())
+    QuitEventLoop();
+}
+
+
+/*
+ * RequestNextUpdate asks for the next update, or resumes paused continuous
+ * updates, once the device is nearly ready for it.  In pipeline mode the
+ * device thread may still be uploading the last update long after we've
+ * decoded it.  An update asked for straight away would then sit in the
+ * server and the socket until the device caught up, and by then it would be
+ * stale.  So the request is held back until the device is within a round
+ * trip of being idle.  The server then folds everything that changed in the
+ * meantime into that one update.
+ */
+
+static Bool
+RequestNextUpdate(void)
+{
+  long rtt = fenceMinRtt >= 0 ? fenceMinRtt : RFBRoundTripMs();
+  long wait = DeviceDrainMs() - (rtt > 0 ? rtt : 0);
+  long budgetWait;
+
+  if (paceTimer)
+    return True;
+
+  /* With -bandwidth, also wait until the budget allows another update. */
+  budgetWait = BandwidthWaitMs();
+  if (budgetWait > wait)
+    wait = budgetWait;
+
+  /* Only the main thread has timers; a stripe's thread can just wait. */
+  if (wait >= PACE_MIN_MS && stripeIndex > 0) {
+    usleep(wait * 1000);
+  } else if (wait >= PACE_MIN_MS) {
+    paceTimer = AddTimer(wait, False, PacedRequest, NULL);
+    if (paceTimer)
+      return True;
+  }
+
+  if (continuousUpdates) {
+    continuousPaused = False;
+    return SendEnableContinuousUpdates(True, viewportX, viewportY,
+                                       viewportWidth, viewportHeight);
+  }
+  return SendIncrementalFramebufferUpdateRequest();
+}
+
+
+/*
+ * SendFlowFence sends a fence carrying the time it was sent.
+ */
+
+static Bool
+SendFlowFence(void)
+{
+  char stamp[4];
+  CARD32 now = (CARD32)CurrentTimeMs();
+
+  stamp[0] = (now >> 24) & 0xff;
+  stamp[1] = (now >> 16) & 0xff;
+  stamp[2] = (now >> 8) & 0xff;
+  stamp[3] = now & 0xff;
+
+  fencePending = True;
+  return SendFence(rfbFenceFlagRequest, sizeof(stamp), stamp);
+}
+
+
+/*
+ * HandleFence.  A fence from the server with the request flag set must be
+ * sent straight back.  We handle messages strictly in order, so every
+ * blocking and sync flag is satisfied just by replying from here.  The first
+ * such fence tells us the server supports them.
+ *
+ * A fence without the request flag is the answer to one of ours.  While the
+ * server streams updates we keep one fence in flight.  The server queues its
+ * answer behind any updates it has already sent, so the time until the answer
+ * arrives is the network round trip plus the time it took us to get through
+ * that backlog.  If that is more than FENCE_MAX_QUEUE_MS beyond the quickest
+ * round trip we've seen, pause the updates and send another fence.  When that
+ * one comes back everything before it has been decoded, so start the updates
+ * again.  This holds the backlog to about one round trip's worth.
+ */
+
+static Bool
+HandleFence(void)
+{
+  char *p;
+  CARD32 flags, sent;
+  int len;
+  long rtt;
+  char data[rfbFenceMaxPayload];
+
+  if ((p = PeekFromRFBServer(sz_rfbFenceMsg - 1)) == NULL)
+    return False;
+  flags = RD_CARD32(p + 3);
+  len = RD_CARD8(p + 7);
+  ConsumeFromRFBServer(sz_rfbFenceMsg - 1);
+
+  if (len > rfbFenceMaxPayload) {
+    fprintf(stderr,"Fence payload too long (%d bytes)\n",len);
+    return False;
+  }
+  if (len > 0 && !ReadFromRFBServer(data, len))
+    return False;
+
+  if (flags & rfbFenceFlagRequest) {
+    flags &= (rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter |
+              rfbFenceFlagSyncNext);
+    if (!SendFence(flags, len, data))
+      return False;
+    if (!serverHasFence) {
+      serverHasFence = True;
+      return StartContinuousUpdates();
+    }
+    return True;
+  }
+
+  if (!fencePending || len != 4)
+    return True;			/* not one of ours */
+  fencePending = False;
+
+  sent = RD_CARD32(data);
+  rtt = (CurrentTimeMs() - sent) & 0xffffffffL;
+  if (fenceMinRtt < 0 || rtt < fenceMinRtt)
+    fenceMinRtt = rtt;
+
+  if (!continuousUpdates)
+    return True;
+
+  if (continuousPaused)
+    return RequestNextUpdate();
+
+  /* Data decoded but still waiting for the device is part of the backlog
+     too. */
+  rtt += DeviceDrainMs();
+
+  if (rtt > fenceMinRtt + FENCE_MAX_QUEUE_MS) {
+    if (appData.debug)
+      fprintf(stderr,"Updates %ldms behind, pausing\n",rtt - fenceMinRtt);
+    continuousPaused = True;
+    return (SendEnableContinuousUpdates(False, viewportX, viewportY,
+                                        viewportWidth, viewportHeight) &&
+            SendFlowFence());
+  }
+
+  return True;
+}
+
+
+/*
+ * EncodingSupported says whether HandleRFBServerMessage can decode the given
+ * encoding.
+ */
+
+Bool
+EncodingSupported(CARD32 encoding)
+{
+  switch (encoding) {
+  case rfbEncodingRaw:
+  case rfbEncodingCopyRect:
+  case rfbEncodingRRE:
+  case rfbEncodingCoRRE:
+  case rfbEncodingHextile:
+  case rfbEncodingZlib:
+  case rfbEncodingTight:
+    return True;
+  default:
+    return False;
+  }
+}
+
+
 #define GET_PIXEL8(pix, ptr) ((pix) = *(ptr)++)
 
 #define GET_PIXEL16(pix, ptr) (((CARD8*)&(pix))[0] = *(ptr)++, \
@@ -1222,24 +2051,24 @@ HandleRFBServerMessage()
 
 #define BPP 8
 #include "rre.c"
-// #include "corre.c"
-// #include "hextile.c"
-// #include "zlib.c"
-// #include "tight.c"
+#include "corre.c"
+#include "hextile.c"
+#include "zlib.c"
+#include "tight.c"
 #undef BPP
 #define BPP 16
 #include "rre.c"
-// #include "corre.c"
-// #include "hextile.c"
-// #include "zlib.c"
-// #include "tight.c"
+#include "corre.c"
+#include "hextile.c"
+#include "zlib.c"
+#include "tight.c"
 #undef BPP
 #define BPP 32
 #include "rre.c"
-// #include "corre.c"
-// #include "hextile.c"
-// #include "zlib.c"
-// #include "tight.c"
+#include "corre.c"
+#include "hextile.c"
+#include "zlib.c"
+#include "tight.c"
 #undef BPP
 
 /*
@@ -1307,21 +2136,25 @@ static long
 ReadCompactLen (void)
 {
   long len;
-  CARD8 b;
+  CARD8 *p;
+  int n = 1;
 
-  if (!ReadFromRFBServer((char *)&b, 1))
+  /* Peek one more byte for as long as the continuation bit is set; the
+     whole value is consumed in one go once its length is known. */
+  if ((p = (CARD8 *)PeekFromRFBServer(1)) == NULL)
     return -1;
-  len = (int)b & 0x7F;
-  if (b & 0x80) {
-    if (!ReadFromRFBServer((char *)&b, 1))
+  len = (int)p[0] & 0x7F;
+  if (p[0] & 0x80) {
+    if ((p = (CARD8 *)PeekFromRFBServer(++n)) == NULL)
       return -1;
-    len |= ((int)b & 0x7F) << 7;
-    if (b & 0x80) {
-      if (!ReadFromRFBServer((char *)&b, 1))
+    len |= ((int)p[1] & 0x7F) << 7;
+    if (p[1] & 0x80) {
+      if ((p = (CARD8 *)PeekFromRFBServer(++n)) == NULL)
         return -1;
-      len |= ((int)b & 0xFF) << 14;
+      len |= ((int)p[2] & 0xFF) << 14;
     }
   }
+  ConsumeFromRFBServer(n);
   return len;
 }
 
@@ -1330,9 +2163,9 @@ ReadCompactLen (void)
  * JPEG source manager functions for JPEG decompression in Tight decoder.
  */
 
-static struct jpeg_source_mgr jpegSrcManager;
-static JOCTET *jpegBufferPtr;
-static size_t jpegBufferLen;
+static PER_CONNECTION struct jpeg_source_mgr jpegSrcManager;
+static PER_CONNECTION JOCTET *jpegBufferPtr;
+static PER_CONNECTION size_t jpegBufferLen;
 
 static void
 JpegInitSource(j_decompress_ptr cinfo)
@@ -30,48 +30,53 @@
 
 #define HandleRREBPP CONCAT2E(HandleRRE,BPP)
 #define CARDBPP CONCAT2E(CARD,BPP)
+#define GET_PIXEL CONCAT2E(GET_PIXEL,BPP)
+
+/* Size of one subrectangle on the wire: a pixel followed by x, y, w, h. */
+#define SZ_RRE_SUBRECT (BPP / 8 + sz_rfbRectangle)
 
 static Bool
 HandleRREBPP (int rx, int ry, int rw, int rh)
 {
-    rfbRREHeader hdr;
-    int i;
+    CARD32 nSubrects;
+    int i, n;
     CARDBPP pix;
-    rfbRectangle subrect;
-    dlo_rect_t rec;
+    CARD8 *ptr;
 
-    if (!ReadFromRFBServer((char *)&hdr, sz_rfbRREHeader))
+    /* Header and background pixel together. */
+    if ((ptr = (CARD8 *)PeekFromRFBServer(sz_rfbRREHeader + BPP / 8)) == NULL)
         return False;
 
-    hdr.nSubrects = Swap32IfLE(hdr.nSubrects);
-
-    if (!ReadFromRFBServer((char *)&pix, sizeof(pix)))
-        return False;
+    nSubrects = RD_CARD32(ptr);
+    ptr += sz_rfbRREHeader;
+    GET_PIXEL(pix, ptr);
+    ConsumeFromRFBServer(sz_rfbRREHeader + BPP / 8);
 
-    rec.origin.x = rx;
-    rec.origin.y = ry;
-    rec.width = rw;
-    rec.height = rh;
-    ERR(dlo_fill_rect(dl_uid, NULL, &rec, pix)); 
-    // ERR(dlo_fill_rect(dl_uid, NULL, &rec, DLO_RGB(0, 0, 0))); 
+    FillRect(rx, ry, rw, rh, pix);
 
-    for (i = 0; i < hdr.nSubrects; i++) {
-        if (!ReadFromRFBServer((char *)&pix, sizeof(pix)))
-            return False;
+    /* Subrectangles are parsed straight out of the receive buffer, as many
+       at a time as will fit in one peek. */
+    while (nSubrects > 0) {
+        n = RFB_MAX_PEEK / SZ_RRE_SUBRECT;
+        if (n > nSubrects)
+            n = nSubrects;
 
-        if (!ReadFromRFBServer((char *)&subrect, sz_rfbRectangle))
+        if ((ptr = (CARD8 *)PeekFromRFBServer(n * SZ_RRE_SUBRECT)) == NULL)
             return False;
 
-        rec.origin.x = rx + Swap16IfLE(subrect.x);
-        rec.origin.y = ry + Swap16IfLE(subrect.y);
-        rec.width  = Swap16IfLE(subrect.w);
-        rec.height = Swap16IfLE(subrect.h);
+        for (i = 0; i < n; i++) {
+            GET_PIXEL(pix, ptr);
+            FillRect(rx + RD_CARD16(ptr), ry + RD_CARD16(ptr + 2),
+                     RD_CARD16(ptr + 4), RD_CARD16(ptr + 6), pix);
+            ptr += sz_rfbRectangle;
+        }
 
-        ERR(dlo_fill_rect(dl_uid, NULL, &rec, pix));
+        ConsumeFromRFBServer(n * SZ_RRE_SUBRECT);
+        nSubrects -= n;
     }
 
     return True;
-
-    error:
-        return False;
 }
+
+#undef GET_PIXEL
+#undef SZ_RRE_SUBRECT
@@ -0,0 +1,372 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * schedule.c - poll different parts of the screen at different rates.
+ *
+ * Normally we ask for the whole viewport again as soon as each update has
+ * been drawn.  With -region, parts of the screen get requests of their own
+ * at the given rate, and -rate sets how often the rest of the viewport is
+ * asked for.  A video pane can then be kept at 30 frames a second while a
+ * clock elsewhere costs one update a second.
+ *
+ * The server answers all the requests it has with one update, and then
+ * forgets them, whether or not anything in them changed.  So a region's
+ * request is outstanding until the next update arrives, and a region which
+ * is due while its request is outstanding just waits for the update.
+ *
+ * "-region auto@HZ" is a region we learn.  The screen is divided into tiles,
+ * and each time the rest of the viewport is polled, the tiles which changed
+ * since the last poll get warmer and the others cool off.  The learned region
+ * is the bounding box of the hot tiles.
+ */
+
+#include <vnc2dl.h>
+
+#define MAX_POLL_REGIONS 16
+
+#define LEARN_TILE 64			/* pixels */
+#define LEARN_MAX_TILES 64		/* each way, so desktops to 4096x4096 */
+#define LEARN_HIT 64			/* warmth for a change at one poll */
+#define LEARN_HOT 128			/* about three polls in a row */
+
+typedef struct {
+  int x, y, w, h;			/* zero size if nothing learned yet */
+  long period;				/* ms; zero for as fast as we can */
+  long due;
+  Bool pending;				/* request sent, no update since */
+} PollRegion;
+
+Bool scheduling = False;
+
+/* The first is the whole viewport, polled at -rate. */
+static PollRegion regions[MAX_POLL_REGIONS + 1];
+static int nRegions = 1;
+static PollRegion *learned = NULL;
+static int pollTimer = 0;
+
+static unsigned short heat[LEARN_MAX_TILES][LEARN_MAX_TILES];
+static CARD8 changed[LEARN_MAX_TILES][LEARN_MAX_TILES];
+
+static void PollRegions(void *data);
+
+
+/*
+ * AddPollRegion adds a region given with -region, as "X,Y,WxH@HZ" or
+ * "auto@HZ".  Returns False if the description is no good.
+ */
+
+Bool
+AddPollRegion(const char *spec)
+{
+  PollRegion *r = &regions[nRegions];
+  int hz;
+
+  if (nRegions > MAX_POLL_REGIONS) {
+    fprintf(stderr,"Too many regions, at most %d\n",MAX_POLL_REGIONS);
+    return False;
+  }
+
+  memset(r, 0, sizeof(*r));
+  if (sscanf(spec, "auto@%d", &hz) == 1) {
+    if (learned) {
+      fprintf(stderr,"Only one region can be learned\n");
+      return False;
+    }
+    learned = r;
+  } else if (sscanf(spec, "%d,%d,%dx%d@%d", &r->x, &r->y, &r->w, &r->h,
+		    &hz) != 5 || r->x < 0 || r->y < 0 || r->w <= 0 ||
+	     r->h <= 0) {
+    return False;
+  }
+  if (hz <= 0)
+    return False;
+
+  r->period = 1000 / hz;
+  nRegions++;
+  scheduling = True;
+  return True;
+}
+
+
+/*
+ * SetPollRate sets how often the rest of the viewport is polled, for
+ * -rate.
+ */
+
+void
+SetPollRate(int hz)
+{
+  regions[0].period = 1000 / hz;
+  scheduling = True;
+}
+
+
+/*
+ * StopPollRate undoes SetPollRate.  With -region the rest of the viewport is
+ * then polled as fast as we can; otherwise we go back to asking for it again
+ * after each update.
+ */
+
+Bool
+StopPollRate(void)
+{
+  Bool pending = regions[0].pending;
+  int i;
+
+  regions[0].period = 0;
+  if (nRegions > 1)
+    return True;
+
+  if (pollTimer)
+    RemoveTimer(pollTimer);
+  pollTimer = 0;
+  for (i = 0; i < nRegions; i++)
+    regions[i].pending = False;
+  scheduling = False;
+
+  /* The update answering a request already sent asks for the next. */
+  if (pending)
+    return True;
+  return SendIncrementalFramebufferUpdateRequest();
+}
+
+
+/*
+ * Set the timer for the next region due, if any.
+ */
+
+static void
+Reschedule(void)
+{
+  long next = -1, now;
+  int i;
+
+  if (pollTimer)
+    RemoveTimer(pollTimer);
+  pollTimer = 0;
+
+  for (i = 0; i < nRegions; i++) {
+    if (regions[i].pending || (regions + i == learned && learned->w == 0))
+      continue;
+    if (next < 0 || regions[i].due < next)
+      next = regions[i].due;
+  }
+  if (next < 0)
+    return;
+
+  now = CurrentTimeMs();
+  pollTimer = AddTimer(next > now ? next - now : 0, False, PollRegions, NULL);
+}
+
+
+/*
+ * PollRegions runs on a timer, and asks for each region which is due.
+ */
+
+static void
+PollRegions(void *data)
+{
+  long now = CurrentTimeMs();
+  long rtt = RFBRoundTripMs();
+  long wait = DeviceDrainMs() - (rtt > 0 ? rtt : 0);
+  long budgetWait = BandwidthWaitMs();
+  PollRegion *r;
+  int x, y, w, h;
+  int i;
+
+  pollTimer = 0;
+
+  /* As in RequestNextUpdate, don't ask for more while the device is still
+     busy with the last update, or while we are over budget. */
+  if (budgetWait > wait)
+    wait = budgetWait;
+  if (wait > 0) {
+    pollTimer = AddTimer(wait, False, PollRegions, NULL);
+    return;
+  }
+
+  for (i = 0; i < nRegions; i++) {
+    r = &regions[i];
+    if (r->pending || r->due > now || (r == learned && r->w == 0))
+      continue;
+
+    if (i == 0) {
+      x = viewportX;
+      y = viewportY;
+      w = viewportWidth;
+      h = viewportHeight;
+    } else {
+      x = r->x;
+      y = r->y;
+      w = r->w;
+      h = r->h;
+    }
+
+    /* Keep to the region's own rate, unless it has fallen a whole period
+       behind. */
+    r->due += r->period;
+    if (r->due <= now)
+      r->due = now + r->period;
+
+    if (!ClipToViewport(&x, &y, &w, &h))
+      continue;
+
+    if (!SendFramebufferUpdateRequest(x, y, w, h, True)) {
+      QuitEventLoop();
+      return;
+    }
+    r->pending = True;
+  }
+
+  Reschedule();
+}
+
+
+/*
+ * Learn warms the tiles which changed since the last poll of the whole
+ * viewport, and cools the rest, then moves the learned region to cover the
+ * hot ones.
+ */
+
+static void
+Learn(void)
+{
+  int tx, ty, x1 = -1, y1 = -1, x2 = -1, y2 = -1;
+  int cols = (si.framebufferWidth + LEARN_TILE - 1) / LEARN_TILE;
+  int rows = (si.framebufferHeight + LEARN_TILE - 1) / LEARN_TILE;
+
+  if (cols > LEARN_MAX_TILES)
+    cols = LEARN_MAX_TILES;
+  if (rows > LEARN_MAX_TILES)
+    rows = LEARN_MAX_TILES;
+
+  for (ty = 0; ty < rows; ty++) {
+    for (tx = 0; tx < cols; tx++) {
+      heat[ty][tx] -= heat[ty][tx] / 4;
+      if (changed[ty][tx])
+	heat[ty][tx] += LEARN_HIT;
+      changed[ty][tx] = 0;
+
+      if (heat[ty][tx] >= LEARN_HOT) {
+	if (x1 < 0 || tx < x1)
+	  x1 = tx;
+	if (tx > x2)
+	  x2 = tx;
+	if (y1 < 0)
+	  y1 = ty;
+	y2 = ty;
+      }
+    }
+  }
+
+  if (x1 < 0) {
+    if (learned->w && appData.debug)
+      fprintf(stderr,"Learned region is quiet\n");
+    learned->w = learned->h = 0;
+    learned->pending = False;
+    return;
+  }
+
+  x1 *= LEARN_TILE;
+  y1 *= LEARN_TILE;
+  x2 = (x2 + 1) * LEARN_TILE;
+  y2 = (y2 + 1) * LEARN_TILE;
+  if (x2 > si.framebufferWidth)
+    x2 = si.framebufferWidth;
+  if (y2 > si.framebufferHeight)
+    y2 = si.framebufferHeight;
+
+  if (x1 == learned->x && y1 == learned->y &&
+      x2 - x1 == learned->w && y2 - y1 == learned->h)
+    return;
+
+  if (learned->w == 0)
+    learned->due = CurrentTimeMs();
+  learned->x = x1;
+  learned->y = y1;
+  learned->w = x2 - x1;
+  learned->h = y2 - y1;
+  if (appData.debug)
+    fprintf(stderr,"Learned region now %dx%d at (%d, %d)\n",
+	    learned->w, learned->h, learned->x, learned->y);
+}
+
+
+/*
+ * StartSchedule sends the first requests.
+ */
+
+void
+StartSchedule(void)
+{
+  long now = CurrentTimeMs();
+  int i;
+
+  fprintf(stderr,"Polling %d region%s", nRegions - 1,
+	  nRegions == 2 ? "" : "s");
+  if (regions[0].period)
+    fprintf(stderr," and the rest at %ldms\n", regions[0].period);
+  else
+    fprintf(stderr," and the rest continuously\n");
+
+  for (i = 0; i < nRegions; i++)
+    regions[i].due = now;
+  PollRegions(NULL);
+}
+
+
+/*
+ * ScheduleChanged is told about each rectangle of an update, for learning.
+ */
+
+void
+ScheduleChanged(int x, int y, int w, int h)
+{
+  int tx, ty;
+
+  if (!learned)
+    return;
+
+  for (ty = y / LEARN_TILE;
+       ty <= (y + h - 1) / LEARN_TILE && ty < LEARN_MAX_TILES; ty++)
+    for (tx = x / LEARN_TILE;
+	 tx <= (x + w - 1) / LEARN_TILE && tx < LEARN_MAX_TILES; tx++)
+      changed[ty][tx] = 1;
+}
+
+
+/*
+ * ScheduleUpdateDone is called at the end of each update.  The server has
+ * answered every request it had, so none is outstanding any more.
+ */
+
+void
+ScheduleUpdateDone(void)
+{
+  int i;
+
+  if (learned && regions[0].pending)
+    Learn();
+
+  for (i = 0; i < nRegions; i++)
+    regions[i].pending = False;
+
+  Reschedule();
+}
@@ -24,12 +24,17 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <assert.h>
 #include <vnc2dl.h>
 
@@ -37,10 +42,75 @@ void PrintInHex(char *buf, int len);
 
 Bool errorMessageOnReadFailure = True;
 
-#define VNC_BUF_SIZE 8192
-static char buf[VNC_BUF_SIZE];
-static char *bufoutptr = buf;
-static int buffered = 0;
+/*
+ * Data from the RFB server is received into a ring buffer.  rbHead and rbTail
+ * are free-running byte counters; RB_OFF() maps them onto the buffer.  The
+ * RFB_MAX_PEEK bytes after the end of the ring are a spill area: when a span
+ * handed out by PeekFromRFBServer would wrap, the wrapped part is copied
+ * there so that the caller always sees contiguous memory.
+ */
+
+#define RFB_BUF_SIZE (256*1024)		/* must be a power of two */
+
+static PER_CONNECTION char rfbBuf[RFB_BUF_SIZE + RFB_MAX_PEEK];
+static PER_CONNECTION unsigned long rbHead = 0;
+static PER_CONNECTION unsigned long rbTail = 0;
+
+#define RB_USED() ((unsigned int)(rbTail - rbHead))
+#define RB_OFF(i) ((unsigned int)(i) & (RFB_BUF_SIZE - 1))
+
+
+/*
+ * Messages for the server are not written one at a time.  QueueRFBMessage
+ * copies them into outBuf, and FlushRFBMessages sends everything queued with
+ * a single writev().  The main loop flushes once per iteration, and we always
+ * flush before blocking in a read, so a request can never sit in the queue
+ * while we wait for its answer.
+ *
+ * While FramebufferUpdateRequests are queued we remember where they are, so
+ * that a new request which is already covered by a pending one can be
+ * dropped, and one which covers a pending request can replace it in place.
+ * SetPixelFormat and SetEncodings act as barriers: requests are never merged
+ * across them.
+ */
+
+#define OUT_BUF_SIZE 8192
+#define MAX_PENDING_FBUR 8
+
+static PER_CONNECTION char outBuf[OUT_BUF_SIZE];
+static PER_CONNECTION int outLen = 0;
+static PER_CONNECTION int pendingFBUR[MAX_PENDING_FBUR];	/* offsets into outBuf */
+static PER_CONNECTION int nPendingFBUR = 0;
+
+static Bool WriteVector(int sock, struct iovec *iov, int niov);
+
+/* Set once UseUringReceive() has handed the socket to uring.c. */
+static PER_CONNECTION Bool uringActive = False;
+
+/*
+ * Receive-path statistics, reset each time they are reported.  blockedUs is
+ * the time spent in poll() waiting for the server to send more, which,
+ * compared with the elapsed time, shows whether we are limited by the
+ * network or by decoding and the device.  The reads themselves, and TLS
+ * decryption, don't count.
+ */
+
+static PER_CONNECTION unsigned long statBytes = 0;
+static PER_CONNECTION unsigned long statReads = 0;
+static PER_CONNECTION long long statBlockedUs = 0;
+static PER_CONNECTION long statStart;
+static PER_CONNECTION int rcvWindow = 0;		/* last seen by WatchRcvWindow */
+static PER_CONNECTION unsigned long totalBytes = 0;	/* never reset */
+static PER_CONNECTION long long totalBlockedUs = 0;	/* never reset */
+
+static long long
+NowUs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 /*
  * ReadFromRFBServer is called whenever we want to read some data from the RFB
@@ -48,173 +118,996 @@ static int buffered = 0;
  *
  * 1. For efficiency it performs some intelligent buffering, avoiding invoking
  *    the read() system call too often.  For small chunks of data, it simply
- *    copies the data out of an internal buffer.  For large amounts of data it
- *    reads directly into the buffer provided by the caller.
+ *    copies the data out of the ring buffer.  For large amounts of data it
+ *    reads directly into the buffer provided by the caller.  Decoders that
+ *    only want to look at a few fields should use PeekFromRFBServer and
+ *    ConsumeFromRFBServer instead, which avoid the copy altogether.
  *
- * 2. Whenever read() would block, it invokes the Xt event dispatching
- *    mechanism to process X events.  In fact, this is the only place these
- *    events are processed, as there is no XtAppMainLoop in the program.
+ * 2. The socket may be in non-blocking mode (it is after -listen).  Once a
+ *    message has started to arrive we need the rest of it, so whenever read()
+ *    would block we sleep in poll() until more data turns up, rather than
+ *    spinning.  Waiting for the start of a message is the job of the main
+ *    event loop (see events.c).
+ */
+
+/*
+ * Report a failed or short read from the server.  Returns False so that
+ * callers can simply "return ReadFailed(i);".
+ */
+
+static Bool
+ReadFailed(int i)
+{
+  if (i < 0) {
+    fprintf(stderr,programName);
+    perror(": read");
+  } else if (errorMessageOnReadFailure) {
+    fprintf(stderr,"%s: VNC server closed connection\n",programName);
+  }
+  return False;
+}
+
+
+/*
+ * Sleep until the RFB socket is readable.
+ */
+
+static Bool
+WaitForRFBSocket(void)
+{
+  struct pollfd pfd;
+  long long waited;
+
+  long long start = NowUs();
+
+  pfd.fd = RFBReadFd();
+  pfd.events = POLLIN;
+
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr,programName);
+      perror(": poll");
+      return False;
+    }
+  }
+  waited = NowUs() - start;
+  statBlockedUs += waited;
+  totalBlockedUs += waited;
+  return True;
+}
+
+
+/*
+ * Would a read from the server return without waiting?  Errors are left for
+ * the read to report.
+ */
+
+static Bool
+RFBDataWaiting(void)
+{
+  struct pollfd pfd;
+
+  if (TlsPending() > 0 || (uringActive && UringBuffered() > 0))
+    return True;
+
+  pfd.fd = RFBReadFd();
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) != 0;
+}
+
+
+/*
+ * Read from the server into iov, by whichever means is in use.  Behaves like
+ * readv().  Any waiting is done in WaitForRFBSocket first, so that it can be
+ * told apart from the time the read itself takes.
+ */
+
+static int
+ReadRFBSocket(struct iovec *iov, int niov)
+{
+  int i;
+
+  if (!RFBDataWaiting() && !WaitForRFBSocket())
+    return -1;
+
+  if (tlsActive)
+    i = TlsReadv(iov, niov);
+  else if (uringActive)
+    i = UringReadv(iov, niov);
+  else
+    i = readv(rfbsock, iov, niov);
+
+  statReads++;
+  if (i > 0) {
+    statBytes += i;
+    totalBytes += i;
+    BandwidthReceived(i);
+  }
+
+#ifdef TCP_QUICKACK
+  /* Linux drops out of quickack mode by itself, so keep re-enabling it.
+     Not worth a system call per read under io_uring. */
+  if (appData.quickAck && i > 0 && !uringActive) {
+    int one = 1;
+    setsockopt(rfbsock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+  }
+#endif
+
+  return i;
+}
+
+
+/*
+ * FillRFBBuffer reads from the socket until at least n bytes are held in the
+ * ring buffer.  Each read asks for all the free space, so one system call
+ * usually satisfies many subsequent small requests.
  */
 
-static Bool rfbsockReady = False;
-// static void
-// rfbsockReadyCallback(XtPointer clientData, int *fd, XtInputId *id)
-// {
-//   rfbsockReady = True;
-//   // XtRemoveInput(*id);
-// }
+static Bool
+FillRFBBuffer(unsigned int n)
+{
+  struct iovec iov[2];
+
+  if (outLen > 0 && !FlushRFBMessages())
+    return False;
+
+  while (RB_USED() < n) {
+    unsigned int space = RFB_BUF_SIZE - RB_USED();
+    unsigned int off = RB_OFF(rbTail);
+    int niov = 1;
+    int i;
+
+    iov[0].iov_base = rfbBuf + off;
+    iov[0].iov_len = space;
+    if (off + space > RFB_BUF_SIZE) {
+      iov[0].iov_len = RFB_BUF_SIZE - off;
+      iov[1].iov_base = rfbBuf;
+      iov[1].iov_len = space - iov[0].iov_len;
+      niov = 2;
+    }
+
+    i = ReadRFBSocket(iov, niov);
+    if (i <= 0) {
+      if (i < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        if (!WaitForRFBSocket())
+          return False;
+        continue;
+      }
+      if (i < 0 && errno == EINTR)
+        continue;
+      return ReadFailed(i);
+    }
+    rbTail += i;
+  }
+
+  return True;
+}
+
+
+/*
+ * Copy n bytes out of the ring buffer, which must already hold them.
+ */
+
+static void
+CopyFromRFBBuffer(char *out, unsigned int n)
+{
+  unsigned int off = RB_OFF(rbHead);
+
+  if (off + n > RFB_BUF_SIZE) {
+    unsigned int first = RFB_BUF_SIZE - off;
+    memcpy(out, rfbBuf + off, first);
+    memcpy(out + first, rfbBuf, n - first);
+  } else {
+    memcpy(out, rfbBuf + off, n);
+  }
+  rbHead += n;
+}
+
 
 Bool
 ReadFromRFBServer(char *out, unsigned int n)
 {
+  unsigned int buffered = RB_USED();
+
   if (n <= buffered) {
-    memcpy(out, bufoutptr, n);
-    bufoutptr += n;
-    buffered -= n;
+    CopyFromRFBBuffer(out, n);
     return True;
   }
 
-  memcpy(out, bufoutptr, buffered);
+  CopyFromRFBBuffer(out, buffered);
 
   out += buffered;
   n -= buffered;
 
-  bufoutptr = buf;
-  buffered = 0;
+  if (n <= RFB_MAX_PEEK) {
+    if (!FillRFBBuffer(n))
+      return False;
+    CopyFromRFBBuffer(out, n);
+    return True;
+  }
 
-  if (n <= VNC_BUF_SIZE) {
+  if (outLen > 0 && !FlushRFBMessages())
+    return False;
 
-    while (buffered < n) {
-      int i = read(rfbsock, buf + buffered, VNC_BUF_SIZE - buffered);
-      if (i <= 0) {
-	if (i < 0) {
-	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        // ProcessXtEvents();
-	    i = 0;
-	  } else {
-	    fprintf(stderr,programName);
-	    perror(": read");
-	    return False;
-	  }
-	} else {
-	  if (errorMessageOnReadFailure) {
-	    fprintf(stderr,"%s: VNC server closed connection\n",programName);
-	  }
-	  return False;
-	}
+  while (n > 0) {
+    struct iovec iov;
+    int i;
+
+    iov.iov_base = out;
+    iov.iov_len = n;
+    i = ReadRFBSocket(&iov, 1);
+    if (i <= 0) {
+      if (i < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        if (!WaitForRFBSocket())
+          return False;
+        continue;
       }
-      buffered += i;
+      if (i < 0 && errno == EINTR)
+        continue;
+      return ReadFailed(i);
     }
+    out += i;
+    n -= i;
+  }
 
-    memcpy(out, bufoutptr, n);
-    bufoutptr += n;
-    buffered -= n;
-    return True;
+  return True;
+}
 
-  } else {
 
-    while (n > 0) {
-      int i = read(rfbsock, out, n);
-      if (i <= 0) {
-	if (i < 0) {
-	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        // ProcessXtEvents();
-	    i = 0;
-	  } else {
-	    fprintf(stderr,programName);
-	    perror(": read");
-	    return False;
-	  }
-	} else {
-	  if (errorMessageOnReadFailure) {
-	    fprintf(stderr,"%s: VNC server closed connection\n",programName);
-	  }
-	  return False;
-	}
-      }
-      out += i;
-      n -= i;
+/*
+ * PeekFromRFBServer returns a pointer to the next n bytes from the server
+ * without consuming them, or NULL if they could not be read.  n may not
+ * exceed RFB_MAX_PEEK.  The span stays valid until the next call into this
+ * module; the caller parses it in place and then calls ConsumeFromRFBServer.
+ */
+
+char *
+PeekFromRFBServer(unsigned int n)
+{
+  unsigned int off;
+
+  assert(n <= RFB_MAX_PEEK);
+
+  if (RB_USED() < n && !FillRFBBuffer(n))
+    return NULL;
+
+  off = RB_OFF(rbHead);
+  if (off + n > RFB_BUF_SIZE)
+    memcpy(rfbBuf + RFB_BUF_SIZE, rfbBuf, off + n - RFB_BUF_SIZE);
+
+  return rfbBuf + off;
+}
+
+
+/*
+ * RFBBytesBuffered returns the number of bytes which have been received from
+ * the server but not yet consumed.  The event loop must not wait for the
+ * socket to become readable while this is non-zero.
+ */
+
+unsigned int
+RFBBytesBuffered(void)
+{
+  return RB_USED() + (uringActive ? UringBuffered() : 0) + TlsPending();
+}
+
+
+/*
+ * RFBBytesConsumed returns the number of bytes of the protocol stream that
+ * have been consumed so far.  It wraps, so only differences are meaningful.
+ */
+
+unsigned long
+RFBBytesConsumed(void)
+{
+  return totalBytes - RB_USED();
+}
+
+
+/*
+ * RFBWaitUs returns the time spent so far waiting for the server to send
+ * more, in microseconds.  As with RFBBytesConsumed, only differences are
+ * meaningful.
+ */
+
+long long
+RFBWaitUs(void)
+{
+  return totalBlockedUs;
+}
+
+
+/*
+ * RFBRoundTripMs returns the kernel's smoothed estimate of the round trip
+ * time to the server, or -1 if it doesn't have one.
+ */
+
+long
+RFBRoundTripMs(void)
+{
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if (getsockopt(rfbsock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+      ti.tcpi_rtt > 0)
+    return ti.tcpi_rtt / 1000;
+#endif
+  return -1;
+}
+
+
+/*
+ * RcvWindow returns how much the kernel is prepared to receive before we
+ * read it, which its receive buffer tuning grows as needed, or -1 if it
+ * doesn't say.
+ */
+
+static int
+RcvWindow(void)
+{
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if (getsockopt(rfbsock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+      ti.tcpi_rcv_space > 0)
+    return ti.tcpi_rcv_space;
+#endif
+  return -1;
+}
+
+
+/*
+ * WatchRcvWindow runs every second with -rcvbuf auto, and reports when the
+ * kernel has grown the receive window.
+ */
+
+static void
+WatchRcvWindow(void *data)
+{
+  int window = RcvWindow();
+
+  if (window > rcvWindow) {
+    if (rcvWindow > 0)
+      fprintf(stderr,"Receive window grown to %dKB\n",window / 1024);
+    rcvWindow = window;
+  }
+}
+
+
+/*
+ * ReportRFBStats runs every -stats seconds and prints what the receive path
+ * has been doing.
+ */
+
+static void
+ReportRFBStats(void *data)
+{
+  long now = CurrentTimeMs();
+  long elapsed = now - statStart;
+  int window = RcvWindow();
+
+  if (elapsed <= 0)
+    return;
+
+  fprintf(stderr,"recv: %lu KB/s, %lu reads/s, %lu bytes/read, "
+	  "blocked %lld ms/s (%d%%), window %dKB\n",
+	  statBytes * 1000 / elapsed / 1024,
+	  statReads * 1000 / elapsed,
+	  statReads ? statBytes / statReads : 0,
+	  statBlockedUs / elapsed,
+	  (int)(statBlockedUs / 10 / elapsed),
+	  window > 0 ? window / 1024 : -1);
+
+  statBytes = statReads = 0;
+  statBlockedUs = 0;
+  statStart = now;
+}
+
+
+/*
+ * TuneRFBSocket applies -rcvbuf to a newly connected socket and starts the
+ * timers -stats and -rcvbuf auto need.
+ *
+ * A receive buffer set by hand stays that size: setting SO_RCVBUF turns off
+ * the kernel's own tuning, which otherwise grows the buffer as far as
+ * net.ipv4.tcp_rmem allows when the link needs it.  Our reads can't show
+ * what the link needs, since each is limited by the ring buffer, so with
+ * -rcvbuf auto the tuning is left to the kernel and we only watch it.
+ */
+
+void
+TuneRFBSocket(void)
+{
+  int size = appData.rcvBuf * 1024;
+
+  if (appData.rcvBuf > 0 &&
+      setsockopt(rfbsock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+    fprintf(stderr,programName);
+    perror(": setsockopt SO_RCVBUF");
+  }
+
+  statStart = CurrentTimeMs();
+  rcvWindow = RcvWindow();
+
+  /* Timers belong to the main thread, so the other connections of a striped
+     session report nothing. */
+  if (stripeIndex > 0)
+    return;
+
+  if (appData.statsInterval)
+    AddTimer(appData.statsInterval * 1000L, True, ReportRFBStats, NULL);
+  if (appData.rcvBuf < 0)
+    AddTimer(1000, True, WatchRcvWindow, NULL);
+}
+
+
+/*
+ * UseUringReceive switches reads from the server over to io_uring (see
+ * uring.c).  Returns False, leaving the ordinary read() path in place, if
+ * that isn't possible.
+ */
+
+Bool
+UseUringReceive(void)
+{
+  if (tlsActive) {
+    fprintf(stderr,"%s: io_uring is not used for TLS sessions\n",programName);
+    return False;
+  }
+  if (!uringActive)
+    uringActive = InitUringReceive(rfbsock);
+  return uringActive;
+}
+
+
+/*
+ * RFBReadFd returns the descriptor which the event loop should watch for
+ * data from the server.
+ */
+
+int
+RFBReadFd(void)
+{
+  return uringActive ? UringFd() : rfbsock;
+}
+
+
+/*
+ * ConsumeFromRFBServer discards n bytes previously returned by
+ * PeekFromRFBServer.
+ */
+
+void
+ConsumeFromRFBServer(unsigned int n)
+{
+  assert(n <= RB_USED());
+  rbHead += n;
+}
+
+
+/*
+ * Does request a make request b redundant?  A non-incremental request covers
+ * an incremental one for the same area, but not vice versa.
+ */
+
+static Bool
+FBURCovers(rfbFramebufferUpdateRequestMsg *a, rfbFramebufferUpdateRequestMsg *b)
+{
+  int ax = Swap16IfLE(a->x), ay = Swap16IfLE(a->y);
+  int bx = Swap16IfLE(b->x), by = Swap16IfLE(b->y);
+
+  if (a->incremental && !b->incremental)
+    return False;
+
+  return (ax <= bx && ay <= by &&
+	  ax + Swap16IfLE(a->w) >= bx + Swap16IfLE(b->w) &&
+	  ay + Swap16IfLE(a->h) >= by + Swap16IfLE(b->h));
+}
+
+
+/*
+ * Try to merge a FramebufferUpdateRequest with one which is already queued.
+ * Returns True if nothing more needs to be queued.
+ */
+
+static Bool
+CoalesceFBUR(rfbFramebufferUpdateRequestMsg *fur)
+{
+  rfbFramebufferUpdateRequestMsg pending;
+  int i;
+
+  for (i = 0; i < nPendingFBUR; i++) {
+    memcpy(&pending, outBuf + pendingFBUR[i],
+	   sz_rfbFramebufferUpdateRequestMsg);
+    if (FBURCovers(&pending, fur))
+      return True;
+    if (FBURCovers(fur, &pending)) {
+      memcpy(outBuf + pendingFBUR[i], fur, sz_rfbFramebufferUpdateRequestMsg);
+      return True;
     }
+  }
 
-    return True;
+  return False;
+}
+
+
+/*
+ * QueueRFBMessage queues a complete client-to-server message (or at least its
+ * fixed-size header) of n bytes.  Any variable-length data which follows the
+ * header should be added with QueueRFBData.
+ */
+
+Bool
+QueueRFBMessage(char *msg, int n)
+{
+  switch ((CARD8)msg[0]) {
+  case rfbFramebufferUpdateRequest:
+    if (CoalesceFBUR((rfbFramebufferUpdateRequestMsg *)msg))
+      return True;
+    if (nPendingFBUR < MAX_PENDING_FBUR) {
+      if (outLen + n > OUT_BUF_SIZE && !FlushRFBMessages())
+	return False;
+      pendingFBUR[nPendingFBUR++] = outLen;
+    }
+    break;
+  /* A request sent after one of these must not be merged into one sent
+     before it: the server would answer it differently, or a fence would
+     no longer separate the two. */
+  case rfbSetPixelFormat:
+  case rfbSetEncodings:
+  case rfbClientFence:
+  case rfbEnableContinuousUpdates:
+    nPendingFBUR = 0;
+    break;
   }
+
+  return QueueRFBData(msg, n);
 }
 
 
 /*
- * Write an exact number of bytes, and don't return until you've sent them.
+ * QueueRFBData queues n bytes for the server.  Data too large for the queue
+ * is sent at once, together with anything already queued.
  */
 
 Bool
-WriteExact(int sock, char *buf, int n)
+QueueRFBData(char *data, int n)
+{
+  struct iovec iov[2];
+
+  if (n > OUT_BUF_SIZE / 2) {
+    iov[0].iov_base = outBuf;
+    iov[0].iov_len = outLen;
+    iov[1].iov_base = data;
+    iov[1].iov_len = n;
+    outLen = 0;
+    nPendingFBUR = 0;
+    return WriteVector(rfbsock, iov, 2);
+  }
+
+  if (outLen + n > OUT_BUF_SIZE && !FlushRFBMessages())
+    return False;
+
+  memcpy(outBuf + outLen, data, n);
+  outLen += n;
+  return True;
+}
+
+
+/*
+ * FlushRFBMessages sends everything queued by QueueRFBMessage.
+ */
+
+Bool
+FlushRFBMessages(void)
 {
-  fd_set fds;
-  int i = 0;
+  struct iovec iov;
+
+  if (outLen == 0)
+    return True;
+
+  iov.iov_base = outBuf;
+  iov.iov_len = outLen;
+  outLen = 0;
+  nPendingFBUR = 0;
+  return WriteVector(rfbsock, &iov, 1);
+}
+
+
+/*
+ * Write out a vector of buffers completely, waiting if the socket is full.
+ */
+
+static Bool
+WriteVector(int sock, struct iovec *iov, int niov)
+{
+  struct pollfd pfd;
   int j;
 
-  while (i < n) {
-    j = write(sock, buf + i, (n - i));
+  if (tlsActive && sock == rfbsock)
+    return TlsWritev(iov, niov);
+
+  while (niov > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      niov--;
+      continue;
+    }
+
+    j = writev(sock, iov, niov);
     if (j <= 0) {
       if (j < 0) {
 	if (errno == EWOULDBLOCK || errno == EAGAIN) {
-	  FD_ZERO(&fds);
-	  FD_SET(rfbsock,&fds);
-
-	  if (select(rfbsock+1, NULL, &fds, NULL, NULL) <= 0) {
+	  pfd.fd = sock;
+	  pfd.events = POLLOUT;
+	  if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
 	    fprintf(stderr,programName);
-	    perror(": select");
+	    perror(": poll");
 	    return False;
 	  }
-	  j = 0;
-	} else {
-	  fprintf(stderr,programName);
-	  perror(": write");
-	  return False;
+	  continue;
+	} else if (errno == EINTR) {
+	  continue;
 	}
-      } else {
-	fprintf(stderr,"%s: write failed\n",programName);
+	fprintf(stderr,programName);
+	perror(": write");
 	return False;
       }
+      fprintf(stderr,"%s: write failed\n",programName);
+      return False;
+    }
+
+    while (niov > 0 && j >= iov->iov_len) {
+      j -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + j;
+      iov->iov_len -= j;
     }
-    i += j;
   }
+
   return True;
 }
 
 
 /*
- * ConnectToTcpAddr connects to the given TCP port.
+ * Write an exact number of bytes, and don't return until you've sent them.
+ * Anything queued for the RFB socket goes first, to preserve ordering.
  */
 
-int
-ConnectToTcpAddr(unsigned int host, int port)
+Bool
+WriteExact(int sock, char *buf, int n)
+{
+  struct iovec iov[2];
+
+  if (sock == rfbsock && outLen > 0) {
+    iov[0].iov_base = outBuf;
+    iov[0].iov_len = outLen;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+    outLen = 0;
+    nPendingFBUR = 0;
+    return WriteVector(sock, iov, 2);
+  }
+
+  iov[0].iov_base = buf;
+  iov[0].iov_len = n;
+  return WriteVector(sock, iov, 1);
+}
+
+
+/*
+ * ConnectToTcpHost connects to a server given by name, which may resolve to
+ * several IPv4 and IPv6 addresses.  The name is looked up asynchronously
+ * where the C library allows, and connections are attempted "happy
+ * eyeballs" style (RFC 8305): addresses are tried alternately by family, a
+ * new attempt starts every CONNECT_ATTEMPT_DELAY ms while earlier ones are
+ * still pending, and the first to complete wins.  Resolving and connecting
+ * together are given CONNECT_TIMEOUT ms.
+ */
+
+#define CONNECT_TIMEOUT 10000
+#define CONNECT_ATTEMPT_DELAY 250
+#define MAX_CONNECT_ADDRS 16
+
+/*
+ * Resolve host, giving up at deadline.  Returns 0 or an EAI_* code.
+ *
+ * The resolver's thread writes the result into the request when it is
+ * done, so the request, and everything it points to, lives on the heap.
+ * One which couldn't be cancelled when we gave up is left there for good.
+ */
+
+#if defined(__GLIBC__) && defined(EAI_INPROGRESS)
+typedef struct {
+  struct gaicb req;
+  struct addrinfo hints;
+  char *host, *service;
+} HostLookup;
+
+static void
+FreeHostLookup(HostLookup *l)
+{
+  free(l->host);
+  free(l->service);
+  free(l);
+}
+#endif
+
+static int
+ResolveHost(const char *host, const char *service, struct addrinfo **res,
+	    long deadline)
+{
+#if defined(__GLIBC__) && defined(EAI_INPROGRESS)
+  struct gaicb *reqs[1];
+  struct timespec ts;
+  HostLookup *l;
+  long left;
+  int err;
+
+  l = calloc(1, sizeof(*l));
+  if (!l)
+    return EAI_MEMORY;
+  l->host = host ? strdup(host) : NULL;
+  l->service = service ? strdup(service) : NULL;
+  if ((host && !l->host) || (service && !l->service)) {
+    FreeHostLookup(l);
+    return EAI_MEMORY;
+  }
+
+  l->hints.ai_family = AF_UNSPEC;
+  l->hints.ai_socktype = SOCK_STREAM;
+  l->hints.ai_flags = AI_ADDRCONFIG;
+  l->req.ar_name = l->host;
+  l->req.ar_service = l->service;
+  l->req.ar_request = &l->hints;
+  reqs[0] = &l->req;
+
+  err = getaddrinfo_a(GAI_NOWAIT, reqs, 1, NULL);
+  if (err != 0) {
+    FreeHostLookup(l);
+    return err;
+  }
+
+  while ((err = gai_error(&l->req)) == EAI_INPROGRESS) {
+    left = deadline - CurrentTimeMs();
+    if (left <= 0) {
+      switch (gai_cancel(&l->req)) {
+      case EAI_CANCELED:
+	FreeHostLookup(l);
+	break;
+      case EAI_ALLDONE:
+	if (gai_error(&l->req) == 0)
+	  freeaddrinfo(l->req.ar_result);
+	FreeHostLookup(l);
+	break;
+      default:
+	/* Still running: its thread will write to it later. */
+	break;
+      }
+      return EAI_AGAIN;
+    }
+    ts.tv_sec = left / 1000;
+    ts.tv_nsec = (left % 1000) * 1000000L;
+    gai_suspend((const struct gaicb * const *)reqs, 1, &ts);
+  }
+
+  *res = l->req.ar_result;
+  FreeHostLookup(l);
+  return err;
+#else
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  return getaddrinfo(host, service, &hints, res);
+#endif
+}
+
+
+/*
+ * Order addresses as RFC 8305 suggests: alternate between families,
+ * starting with whichever the resolver put first.
+ */
+
+static int
+InterleaveAddrs(struct addrinfo *list, struct addrinfo **out)
+{
+  struct addrinfo *first[MAX_CONNECT_ADDRS], *other[MAX_CONNECT_ADDRS];
+  struct addrinfo *ai;
+  int nFirst = 0, nOther = 0, n = 0, i = 0, j = 0;
+
+  for (ai = list; ai; ai = ai->ai_next) {
+    if (ai->ai_family == list->ai_family) {
+      if (nFirst < MAX_CONNECT_ADDRS)
+	first[nFirst++] = ai;
+    } else {
+      if (nOther < MAX_CONNECT_ADDRS)
+	other[nOther++] = ai;
+    }
+  }
+
+  while (n < MAX_CONNECT_ADDRS && (i < nFirst || j < nOther)) {
+    if (i < nFirst)
+      out[n++] = first[i++];
+    if (j < nOther && n < MAX_CONNECT_ADDRS)
+      out[n++] = other[j++];
+  }
+  return n;
+}
+
+
+/*
+ * Start a non-blocking connect to ai.  Returns the socket, or -1 if this
+ * address failed immediately.
+ */
+
+static int
+StartConnect(struct addrinfo *ai)
 {
   int sock;
-  struct sockaddr_in addr;
+
+  sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (sock < 0)
+    return -1;
+
+  if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0 ||
+      (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 &&
+       errno != EINPROGRESS)) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+
+int
+ConnectToTcpHost(const char *host, int port)
+{
+  struct addrinfo *list = NULL;
+  struct addrinfo *addrs[MAX_CONNECT_ADDRS];
+  struct pollfd pfds[MAX_CONNECT_ADDRS];
+  char service[16];
+  long deadline = CurrentTimeMs() + CONNECT_TIMEOUT;
+  long now, nextAttempt;
+  int nAddrs, nextAddr = 0, nPending = 0;
+  int sock = -1, lastErr = ETIMEDOUT;
+  int err, i, wait, soErr;
+  socklen_t len;
   int one = 1;
 
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = host;
+  sprintf(service, "%d", port);
+
+  err = ResolveHost(host[0] ? host : NULL, service, &list, deadline);
+  if (err != 0) {
+    fprintf(stderr,"%s: can't resolve '%s': %s\n",programName,host,
+	    gai_strerror(err));
+    return -1;
+  }
+
+  nAddrs = InterleaveAddrs(list, addrs);
+  nextAttempt = CurrentTimeMs();
+
+  while (sock < 0) {
+    now = CurrentTimeMs();
+
+    /* Start another attempt if it's time, or if nothing else is going on. */
+    while (nextAddr < nAddrs && (now >= nextAttempt || nPending == 0)) {
+      pfds[nPending].fd = StartConnect(addrs[nextAddr++]);
+      if (pfds[nPending].fd < 0) {
+	lastErr = errno;
+	continue;
+      }
+      pfds[nPending].events = POLLOUT;
+      nPending++;
+      nextAttempt = now + CONNECT_ATTEMPT_DELAY;
+      break;
+    }
+
+    if (nPending == 0 || now >= deadline)
+      break;
+
+    wait = deadline - now;
+    if (nextAddr < nAddrs && nextAttempt - now < wait)
+      wait = nextAttempt - now;
+
+    if (poll(pfds, nPending, wait) < 0) {
+      if (errno == EINTR)
+	continue;
+      lastErr = errno;
+      break;
+    }
+
+    for (i = 0; i < nPending; i++) {
+      if (!pfds[i].revents)
+	continue;
+      len = sizeof(soErr);
+      if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soErr, &len) < 0)
+	soErr = errno;
+      if (soErr == 0) {
+	sock = pfds[i].fd;
+      } else {
+	lastErr = soErr;
+	close(pfds[i].fd);
+      }
+      pfds[i--] = pfds[--nPending];
+      if (sock >= 0)
+	break;
+    }
+  }
+
+  for (i = 0; i < nPending; i++)
+    close(pfds[i].fd);
+  freeaddrinfo(list);
 
-  sock = socket(AF_INET, SOCK_STREAM, 0);
   if (sock < 0) {
-    fprintf(stderr,programName);
-    perror(": ConnectToTcpAddr: socket");
+    fprintf(stderr,"%s: ConnectToTcpHost: %s\n",programName,strerror(lastErr));
     return -1;
   }
 
-  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+  /* The rest of the code expects a blocking socket. */
+  if (fcntl(sock, F_SETFL, 0) < 0 ||
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+		 (char *)&one, sizeof(one)) < 0) {
     fprintf(stderr,programName);
-    perror(": ConnectToTcpAddr: connect");
+    perror(": ConnectToTcpHost: setsockopt");
     close(sock);
     return -1;
   }
 
-  if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
-		 (char *)&one, sizeof(one)) < 0) {
+  return sock;
+}
+
+
+/*
+ * Fill in a Unix-domain socket address for path.
+ */
+
+static Bool
+MakeUnixAddr(const char *path, struct sockaddr_un *addr)
+{
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr,"%s: socket path '%s' too long\n",programName,path);
+    return False;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return True;
+}
+
+
+/*
+ * ConnectToUnixAddr connects to a Unix-domain socket on this machine.
+ */
+
+int
+ConnectToUnixAddr(const char *path)
+{
+  int sock;
+  struct sockaddr_un addr;
+
+  if (!MakeUnixAddr(path, &addr))
+    return -1;
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
     fprintf(stderr,programName);
-    perror(": ConnectToTcpAddr: setsockopt");
+    perror(": ConnectToUnixAddr: socket");
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr,programName);
+    perror(": ConnectToUnixAddr: connect");
     close(sock);
     return -1;
   }
@@ -223,7 +1116,6 @@ ConnectToTcpAddr(unsigned int host, int port)
 }
 
 
-
 /*
  * FindFreeTcpPort tries to find unused TCP port in the range
  * (TUNNEL_PORT_OFFSET, TUNNEL_PORT_OFFSET + 99]. Returns 0 on failure.
@@ -338,65 +1230,137 @@ AcceptTcpConnection(int listenSock)
 
 
 /*
- * SetNonBlocking sets a socket into non-blocking mode.
+ * Is something listening on the Unix-domain socket at addr?
  */
 
-Bool
-SetNonBlocking(int sock)
+static Bool
+UnixPathInUse(struct sockaddr_un *addr)
 {
-  if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
-    fprintf(stderr,programName);
-    perror(": AcceptTcpConnection: fcntl");
+  int sock;
+  Bool inUse;
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
     return False;
-  }
-  return True;
+  inUse = (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+  close(sock);
+  return inUse;
 }
 
 
 /*
- * StringToIPAddr - convert a host string to an IP address.
+ * ListenAtUnixPath starts listening on a Unix-domain socket.  A socket left
+ * behind at path by an earlier run is removed; anything else there is not,
+ * including a socket which another process is still listening on.
  */
 
-Bool
-StringToIPAddr(const char *str, unsigned int *addr)
+int
+ListenAtUnixPath(const char *path)
 {
-  struct hostent *hp;
+  int sock;
+  struct sockaddr_un addr;
+  struct stat st;
 
-  if (strcmp(str,"") == 0) {
-    *addr = 0; /* local */
-    return True;
+  if (!MakeUnixAddr(path, &addr))
+    return -1;
+
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (UnixPathInUse(&addr)) {
+      fprintf(stderr,"%s: %s is already in use\n",programName,path);
+      return -1;
+    }
+    unlink(path);
   }
 
-  *addr = inet_addr(str);
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    fprintf(stderr,programName);
+    perror(": ListenAtUnixPath: socket");
+    return -1;
+  }
 
-  if (*addr != -1)
-    return True;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr,programName);
+    perror(": ListenAtUnixPath: bind");
+    close(sock);
+    return -1;
+  }
 
-  hp = gethostbyname(str);
+  if (listen(sock, 5) < 0) {
+    fprintf(stderr,programName);
+    perror(": ListenAtUnixPath: listen");
+    close(sock);
+    return -1;
+  }
 
-  if (hp) {
-    *addr = *(unsigned int *)hp->h_addr;
-    return True;
+  return sock;
+}
+
+
+/*
+ * AcceptUnixConnection accepts a connection on a Unix-domain socket.
+ */
+
+int
+AcceptUnixConnection(int listenSock)
+{
+  int sock;
+
+  sock = accept(listenSock, NULL, NULL);
+  if (sock < 0) {
+    fprintf(stderr,programName);
+    perror(": AcceptUnixConnection: accept");
+    return -1;
   }
 
-  return False;
+  return sock;
 }
 
 
 /*
- * Test if the other end of a socket is on the same machine.
+ * SetNonBlocking sets a socket into non-blocking mode.
+ */
+
+Bool
+SetNonBlocking(int sock)
+{
+  if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+    fprintf(stderr,programName);
+    perror(": AcceptTcpConnection: fcntl");
+    return False;
+  }
+  return True;
+}
+
+
+/*
+ * Test if the other end of a socket is on the same machine.  Unix-domain
+ * sockets always are.
  */
 
 Bool
 SameMachine(int sock)
 {
-  struct sockaddr_in peeraddr, myaddr;
-  int addrlen = sizeof(struct sockaddr_in);
+  struct sockaddr_storage peeraddr, myaddr;
+  socklen_t peerlen = sizeof(peeraddr), mylen = sizeof(myaddr);
+
+  if (getsockname(sock, (struct sockaddr *)&myaddr, &mylen) < 0)
+    return False;
+
+  if (myaddr.ss_family == AF_UNIX)
+    return True;
+
+  if (getpeername(sock, (struct sockaddr *)&peeraddr, &peerlen) < 0 ||
+      peeraddr.ss_family != myaddr.ss_family)
+    return False;
 
-  getpeername(sock, (struct sockaddr *)&peeraddr, &addrlen);
-  getsockname(sock, (struct sockaddr *)&myaddr, &addrlen);
+  if (myaddr.ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6 *)&peeraddr)->sin6_addr,
+		  &((struct sockaddr_in6 *)&myaddr)->sin6_addr,
+		  sizeof(struct in6_addr)) == 0;
 
-  return (peeraddr.sin_addr.s_addr == myaddr.sin_addr.s_addr);
+  return (((struct sockaddr_in *)&peeraddr)->sin_addr.s_addr ==
+	  ((struct sockaddr_in *)&myaddr)->sin_addr.s_addr);
 }
 
 
@@ -0,0 +1,236 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * stripes.c - decode the screen on several connections at once.
+ *
+ * One connection is decoded by one thread, so a heavily compressed stream
+ * can keep one core busy while the rest have nothing to do.  With
+ * -stripes N we open N shared connections to the server and split the
+ * viewport into N horizontal bands.  Each connection asks only for its own
+ * band, and each after the first is read and decoded by a thread of its
+ * own, straight onto the device.
+ *
+ * Everything that belongs to a connection, from the receive buffer to the
+ * zlib streams, is declared PER_CONNECTION, so each thread has its own and
+ * the protocol code is the same whichever thread runs it.  The main
+ * connection still does everything else: input, the cursor, resizing and
+ * panning.  Device output is locked while more than one thread uses it (see
+ * dldevice.c).
+ *
+ * The other connections have no event loop and so no timers.  This is why
+ * striping turns off the features which need them on every connection:
+ * continuous updates, automatic encoding selection and lossless refinement,
+ * and why the server draws its own cursor.
+ */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <vnc2dl.h>
+
+/* 0 is the main connection. */
+PER_CONNECTION int stripeIndex = 0;
+
+typedef struct {
+  int index;
+  pthread_t thread;
+  int sock;				/* -1 until connected */
+} Stripe;
+
+static Stripe stripes[MAX_STRIPES];
+static int nStripes = 0;
+
+/* Handshakes are done one at a time: VNC authentication's DES code keeps
+   its key schedule in static variables. */
+static pthread_mutex_t handshakeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped when the encodings change (see control.c); each thread sends
+   SetEncodings again when it sees it move. */
+static int encodingsChanged = 0;
+
+/* A thread which loses its connection writes to this to end the session. */
+static int lostPipe[2];
+static Bool stopping = False;
+
+
+/*
+ * StripeThread runs one connection after the first.
+ */
+
+static void *
+StripeThread(void *arg)
+{
+  Stripe *s = arg;
+  int encodingsSent = __atomic_load_n(&encodingsChanged, __ATOMIC_ACQUIRE);
+  Bool ok;
+
+  stripeIndex = s->index;
+
+  pthread_mutex_lock(&handshakeMutex);
+  ok = (ConnectToRFBServer(vncServerHost, vncServerPort) &&
+	InitialiseRFBConnection());
+  pthread_mutex_unlock(&handshakeMutex);
+
+  if (ok) {
+    s->sock = rfbsock;
+    TuneRFBSocket();
+    ok = (SetFormatAndEncodings() &&
+	  SendIncrementalFramebufferUpdateRequest() &&
+	  FlushRFBMessages());
+  }
+
+  while (ok && !stopping) {
+    if (__atomic_load_n(&encodingsChanged, __ATOMIC_ACQUIRE) != encodingsSent) {
+      encodingsSent = __atomic_load_n(&encodingsChanged, __ATOMIC_ACQUIRE);
+      ok = SendEncodings();
+    }
+    ok = ok && HandleRFBServerMessage() && FlushRFBMessages();
+  }
+
+  if (!stopping) {
+    fprintf(stderr,"%s: lost connection for stripe %d\n",programName,
+	    s->index);
+    write(lostPipe[1], "", 1);
+  }
+  return NULL;
+}
+
+
+/*
+ * Stripe threads report a lost connection here, in the main thread.
+ */
+
+static void
+StripeLost(int fd, void *data)
+{
+  QuitEventLoop();
+}
+
+
+/*
+ * StartStripes starts a thread for each connection after the first, if
+ * -stripes was given.  The main connection must be set up already.
+ */
+
+Bool
+StartStripes(void)
+{
+  int i;
+
+  if (appData.stripes <= 1)
+    return True;
+
+  if (pipe(lostPipe) < 0) {
+    fprintf(stderr,programName);
+    perror(": pipe");
+    return False;
+  }
+  if (!AddEventFd(lostPipe[0], StripeLost, NULL))
+    return False;
+
+  ShareDevice();
+
+  fprintf(stderr,"Decoding %d stripes of the screen in parallel\n",
+	  appData.stripes);
+
+  for (i = 1; i < appData.stripes; i++) {
+    stripes[nStripes].index = i;
+    stripes[nStripes].sock = -1;
+    if (pthread_create(&stripes[nStripes].thread, NULL, StripeThread,
+		       &stripes[nStripes]) != 0) {
+      fprintf(stderr,"%s: cannot start thread for stripe %d\n",programName,i);
+      return False;
+    }
+    nStripes++;
+  }
+  return True;
+}
+
+
+/*
+ * StopStripes shuts down the other connections and waits for their
+ * threads, which must be done before the device is released.
+ */
+
+void
+StopStripes(void)
+{
+  int i;
+
+  if (nStripes == 0)
+    return;
+
+  stopping = True;
+  errorMessageOnReadFailure = False;
+  for (i = 0; i < nStripes; i++) {
+    if (stripes[i].sock >= 0)
+      shutdown(stripes[i].sock, SHUT_RDWR);
+  }
+  for (i = 0; i < nStripes; i++)
+    pthread_join(stripes[i].thread, NULL);
+  nStripes = 0;
+}
+
+
+/*
+ * StripesResendEncodings has the other connections send SetEncodings again,
+ * after the next message each of them receives.
+ */
+
+void
+StripesResendEncodings(void)
+{
+  __atomic_add_fetch(&encodingsChanged, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * GetStripeBand gives the part of the viewport this connection asks for:
+ * the whole of it without -stripes.
+ */
+
+void
+GetStripeBand(int *x, int *y, int *w, int *h)
+{
+  int n = appData.stripes > 1 ? appData.stripes : 1;
+
+  LockDevice();
+  *x = viewportX;
+  *w = viewportWidth;
+  *y = viewportY + viewportHeight * stripeIndex / n;
+  *h = viewportY + viewportHeight * (stripeIndex + 1) / n - *y;
+  UnlockDevice();
+}
+
+
+/*
+ * InStripeBand says whether a rectangle is within this connection's band.
+ */
+
+Bool
+InStripeBand(int x, int y, int w, int h)
+{
+  int bx, by, bw, bh;
+
+  if (appData.stripes <= 1)
+    return True;
+
+  GetStripeBand(&bx, &by, &bw, &bh);
+  return x >= bx && y >= by && x + w <= bx + bw && y + h <= by + bh;
+}
@@ -79,7 +79,9 @@ static void FilterCopyBPP (int numRows, CARDBPP *destBuffer);
 static void FilterPaletteBPP (int numRows, CARDBPP *destBuffer);
 static void FilterGradientBPP (int numRows, CARDBPP *destBuffer);
 
+#if BPP != 8
 static Bool DecompressJpegRectBPP(int x, int y, int w, int h);
+#endif
 
 /* Definitions */
 
@@ -87,7 +89,6 @@ static Bool
 HandleTightBPP (int rx, int ry, int rw, int rh)
 {
   CARDBPP fill_colour;
-  XGCValues gcv;
   CARD8 comp_ctl;
   CARD8 filter_id;
   filterPtrBPP filterFn;
@@ -95,7 +96,6 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
   char *buffer2;
   int err, stream_id, compressedLen, bitsPixel;
   int bufferSize, rowSize, numRows, portionLen, rowsProcessed, extraBytes;
-  CARDBPP *rawData;
 
   if (!ReadFromRFBServer((char *)&comp_ctl, 1))
     return False;
@@ -128,15 +128,7 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
 	return False;
 #endif
 
-#if (BPP == 8)
-    gcv.foreground = (appData.useBGR233) ?
-      BGR233ToPixel[fill_colour] : fill_colour;
-#else
-    gcv.foreground = fill_colour;
-#endif
-
-    XChangeGC(dpy, gc, GCForeground, &gcv);
-    XFillRectangle(dpy, desktopWin, gc, rx, ry, rw, rh);
+    FillRect(rx, ry, rw, rh, fill_colour);
     return True;
   }
 
@@ -435,7 +427,7 @@ FilterGradientBPP (int numRows, CARDBPP *dst)
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = (CARD16)((src[y*rectWidth] >> shift[c]) + thatRow[c] & max[c]);
+      pix[c] = (CARD16)(((src[y*rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
       thisRow[c] = pix[c];
     }
     dst[y*rectWidth] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
@@ -449,7 +441,7 @@ FilterGradientBPP (int numRows, CARDBPP *dst)
 	} else if (est[c] < 0) {
 	  est[c] = 0;
 	}
-	pix[c] = (CARD16)((src[y*rectWidth+x] >> shift[c]) + est[c] & max[c]);
+	pix[c] = (CARD16)(((src[y*rectWidth+x] >> shift[c]) + est[c]) & max[c]);
 	thisRow[x*3+c] = pix[c];
       }
       dst[y*rectWidth+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
@@ -461,9 +453,7 @@ FilterGradientBPP (int numRows, CARDBPP *dst)
 static int
 InitFilterPaletteBPP (int rw, int rh)
 {
-  int i;
   CARD8 numColors;
-  CARDBPP *palette = (CARDBPP *)tightPalette;
 
   rectWidth = rw;
 
@@ -477,6 +467,9 @@ InitFilterPaletteBPP (int rw, int rh)
 #if BPP == 32
   if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
       myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
+    CARDBPP *palette = (CARDBPP *)tightPalette;
+    int i;
+
     if (!ReadFromRFBServer((char*)&tightPalette, rectColors * 3))
       return 0;
     for (i = rectColors - 1; i >= 0; i--) {
@@ -544,7 +537,14 @@ DecompressJpegRectBPP(int x, int y, int w, int h)
   CARD8 *compressedData;
   CARDBPP *pixelPtr;
   JSAMPROW rowPointer[1];
-  int dx, dy;
+  int dx, dy, batchStart, batchRows;
+
+  /* A row must fit in half the buffer (see below). */
+  if (w * (BPP / 8) > BUFFER_SIZE / 2) {
+    fprintf(stderr, "Tight Encoding: JPEG rectangle too wide (%d pixels).\n",
+	    w);
+    return False;
+  }
 
   compressedLen = (int)ReadCompactLen();
   if (compressedLen <= 0) {
@@ -580,21 +580,31 @@ DecompressJpegRectBPP(int x, int y, int w, int h)
     return False;
   }
 
+  /* Scanlines are decoded into the first half of the buffer and converted
+     into the second, which is sent to the device when it is full. */
   rowPointer[0] = (JSAMPROW)buffer;
-  dy = 0;
+  batchRows = (BUFFER_SIZE / 2) / (w * (BPP / 8));
+  pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
+  dy = batchStart = 0;
   while (cinfo.output_scanline < cinfo.output_height) {
     jpeg_read_scanlines(&cinfo, rowPointer, 1);
     if (jpegError) {
       break;
     }
-    pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
     for (dx = 0; dx < w; dx++) {
       *pixelPtr++ =
 	RGB24_TO_PIXEL(BPP, buffer[dx*3], buffer[dx*3+1], buffer[dx*3+2]);
     }
-    CopyDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + dy, w, 1);
-    dy++;
+    if (++dy - batchStart == batchRows) {
+      CopyDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + batchStart, w,
+		       dy - batchStart);
+      pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
+      batchStart = dy;
+    }
   }
+  if (dy > batchStart)
+    CopyDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + batchStart, w,
+		     dy - batchStart);
 
   if (!jpegError)
     jpeg_finish_decompress(&cinfo);
@@ -602,6 +612,9 @@ DecompressJpegRectBPP(int x, int y, int w, int h)
   jpeg_destroy_decompress(&cinfo);
   free(compressedData);
 
+  if (!jpegError)
+    RefineMarkLossy(x, y, w, h);
+
   return !jpegError;
 }
 
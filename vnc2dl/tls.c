@@ -0,0 +1,262 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * tls.c - TLS on the RFB connection, for the VeNCrypt security type.
+ *
+ * Once StartTLS() has completed the handshake, sockets.c sends everything
+ * to and from the server through TlsReadv() and TlsWritev().  OpenSSL uses
+ * the CPU's AES instructions where it has them, and we list the AES-GCM
+ * suites first so that those are what we normally end up with.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <vnc2dl.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_CIPHERS "AESGCM:HIGH:!aNULL:!MD5:!RC4"
+#define TLS_ANON_CIPHERS "aNULL+AESGCM:aNULL+HIGH:!eNULL:@SECLEVEL=0"
+
+PER_CONNECTION Bool tlsActive = False;
+
+static PER_CONNECTION SSL_CTX *ctx = NULL;
+static PER_CONNECTION SSL *ssl = NULL;
+
+
+/*
+ * Report the OpenSSL error queue.
+ */
+
+static void
+TlsError(const char *what)
+{
+  unsigned long e;
+
+  fprintf(stderr,"%s: %s failed\n",programName,what);
+  while ((e = ERR_get_error()) != 0)
+    fprintf(stderr,"  %s\n",ERR_error_string(e, NULL));
+}
+
+
+/*
+ * Deal with an SSL_ERROR_WANT_* result by waiting for the socket.  Returns
+ * False for any other error, which has been reported.
+ */
+
+static Bool
+TlsRetry(int ret, const char *what)
+{
+  struct pollfd pfd;
+
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    pfd.events = POLLIN;
+    break;
+  case SSL_ERROR_WANT_WRITE:
+    pfd.events = POLLOUT;
+    break;
+  case SSL_ERROR_SYSCALL:
+    if (errno == EINTR)
+      return True;
+    if (errno != 0) {
+      fprintf(stderr,programName);
+      perror(what);
+      return False;
+    }
+    /* fall through */
+  default:
+    TlsError(what);
+    return False;
+  }
+
+  pfd.fd = rfbsock;
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr,programName);
+      perror(": poll");
+      return False;
+    }
+  }
+  return True;
+}
+
+
+/*
+ * StartTLS performs a TLS handshake on sock.  An anonymous session uses
+ * Diffie-Hellman without certificates, which only exists up to TLS 1.2.
+ * Otherwise the server's certificate is checked against the CA file given
+ * with -x509ca, if any.
+ */
+
+Bool
+StartTLS(int sock, Bool anonymous)
+{
+  int ret;
+
+  ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    TlsError("SSL_CTX_new");
+    return False;
+  }
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  /* Pull in as much as the socket has each time, rather than a record
+     header and then a record. */
+  SSL_CTX_set_read_ahead(ctx, 1);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  /* Servers often just close the socket; RFB messages are self-delimiting,
+     so treat that like any other end of session. */
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  if (anonymous) {
+    fprintf(stderr,"Warning: anonymous TLS, the server is not authenticated "
+	    "(use -x509ca)\n");
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    if (!SSL_CTX_set_cipher_list(ctx, TLS_ANON_CIPHERS)) {
+      TlsError("SSL_CTX_set_cipher_list");
+      return False;
+    }
+  } else {
+    if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS)) {
+      TlsError("SSL_CTX_set_cipher_list");
+      return False;
+    }
+    if (appData.x509CA) {
+      if (!SSL_CTX_load_verify_locations(ctx, appData.x509CA, NULL)) {
+	TlsError(appData.x509CA);
+	return False;
+      }
+      SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+      fprintf(stderr,"Warning: server certificate not verified "
+	      "(use -x509ca)\n");
+    }
+  }
+
+  ssl = SSL_new(ctx);
+  if (!ssl || !SSL_set_fd(ssl, sock)) {
+    TlsError("SSL_new");
+    return False;
+  }
+
+  if (!anonymous && appData.x509CA && !IsUnixHost(vncServerHost) &&
+      vncServerHost[0] != '\0') {
+    SSL_set_tlsext_host_name(ssl, vncServerHost);
+    SSL_set1_host(ssl, vncServerHost);
+  }
+
+  while ((ret = SSL_connect(ssl)) != 1) {
+    if (!TlsRetry(ret, ": TLS handshake"))
+      return False;
+  }
+
+  fprintf(stderr,"Using %s with %s\n",SSL_get_version(ssl),
+	  SSL_get_cipher_name(ssl));
+
+  tlsActive = True;
+  return True;
+}
+
+
+/*
+ * TlsReadv behaves like readv() on the RFB socket, but decrypts.  It waits
+ * for data if there is none, and returns 0 when the server closes the
+ * session.
+ */
+
+int
+TlsReadv(struct iovec *iov, int niov)
+{
+  int total = 0;
+  int i = 0;
+  int n;
+
+  while (i < niov) {
+    n = SSL_read(ssl, iov[i].iov_base, iov[i].iov_len);
+    if (n > 0) {
+      total += n;
+      if (n < iov[i].iov_len || SSL_pending(ssl) == 0)
+	break;
+      i++;
+      continue;
+    }
+
+    if (total > 0)
+      break;
+    if (SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN)
+      return 0;
+    if (!TlsRetry(n, ": SSL_read")) {
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  return total;
+}
+
+
+/*
+ * TlsWritev encrypts and sends all of iov.
+ */
+
+Bool
+TlsWritev(struct iovec *iov, int niov)
+{
+  int i, n;
+  char *p;
+  size_t left;
+
+  for (i = 0; i < niov; i++) {
+    p = iov[i].iov_base;
+    left = iov[i].iov_len;
+    while (left > 0) {
+      n = SSL_write(ssl, p, left);
+      if (n > 0) {
+	p += n;
+	left -= n;
+      } else if (!TlsRetry(n, ": SSL_write")) {
+	return False;
+      }
+    }
+  }
+  return True;
+}
+
+
+/*
+ * TlsPending returns the number of decrypted bytes waiting to be read.  If
+ * OpenSSL holds data it has not yet decrypted, the result is at least 1, so
+ * that the caller knows not to wait for the socket.
+ */
+
+unsigned int
+TlsPending(void)
+{
+  unsigned int n;
+
+  if (!tlsActive)
+    return 0;
+  n = SSL_pending(ssl);
+  if (n == 0 && SSL_has_pending(ssl))
+    n = 1;
+  return n;
+}
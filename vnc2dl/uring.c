@@ -0,0 +1,395 @@
+/*
+ *  Copyright (c) 2009 Q.Stafford-Fraser, Camvine. All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * uring.c - receive from the RFB socket through io_uring (-iouring).
+ *
+ * A single multishot recv request is kept armed on the socket.  The kernel
+ * picks a buffer from a ring of URING_NBUFS buffers which we registered with
+ * it, fills it, and posts a completion, without any system call on our side.
+ * UringReadv() copies completed data into the caller's iovecs and hands each
+ * buffer back to the kernel as soon as it is empty, so several buffers can be
+ * in flight while we decode.  We only enter the kernel when there are no
+ * completions waiting, or to re-arm the request.
+ *
+ * This talks to the kernel interface directly rather than through liburing,
+ * so there is nothing extra to link against.  If the kernel (or the headers
+ * we were built with) can't do multishot recv with provided buffers,
+ * InitUringReceive() fails and sockets.c carries on using read().
+ */
+
+#include <errno.h>
+#include <vnc2dl.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 4
+#define URING_NBUFS 16			/* must be a power of two */
+#define URING_BUF_SIZE (64*1024)
+#define URING_BGID 0
+
+static int ringFd = -1;
+static int ringSock = -1;
+
+/* Submission queue */
+static unsigned *sqTail, *sqMask, *sqArray;
+static struct io_uring_sqe *sqes;
+
+/* Completion queue */
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_cqe *cqes;
+
+/* Provided buffers */
+static struct io_uring_buf_ring *bufRing;
+static char *bufs;
+static unsigned short bufTail = 0;
+
+/* The buffer we are currently copying out of, if any. */
+static int curBid = -1;
+static unsigned int curOff, curLen;
+
+static Bool recvArmed = False;
+static Bool recvEOF = False;
+static int recvErrno = 0;
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, x) __atomic_store_n((p), (x), __ATOMIC_RELEASE)
+
+
+static int
+SysUringSetup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+SysUringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+		      flags, NULL, 0);
+}
+
+static int
+SysUringRegister(unsigned opcode, void *arg, unsigned nrArgs)
+{
+  return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+}
+
+
+/*
+ * Give buffer bid back to the kernel.
+ */
+
+static void
+RecycleBuffer(int bid)
+{
+  struct io_uring_buf *b = &bufRing->bufs[bufTail & (URING_NBUFS - 1)];
+
+  b->addr = (unsigned long)(bufs + (unsigned long)bid * URING_BUF_SIZE);
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  bufTail++;
+  STORE(&bufRing->tail, bufTail);
+}
+
+
+/*
+ * Queue a multishot recv on the socket.  It stays active, producing one
+ * completion per buffer filled, until it runs out of buffers or fails.
+ */
+
+static Bool
+ArmRecv(void)
+{
+  unsigned tail = *sqTail;
+  unsigned idx = tail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = ringSock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqArray[idx] = idx;
+  STORE(sqTail, tail + 1);
+
+  if (SysUringEnter(1, 0, 0) < 0) {
+    fprintf(stderr,programName);
+    perror(": io_uring_enter");
+    return False;
+  }
+
+  recvArmed = True;
+  return True;
+}
+
+
+/*
+ * Take one completion off the queue, if there is one.  Returns False if
+ * the queue was empty.
+ */
+
+static Bool
+ReapCompletion(void)
+{
+  unsigned head = *cqHead;
+  struct io_uring_cqe *cqe;
+
+  if (head == LOAD(cqTail))
+    return False;
+
+  cqe = &cqes[head & *cqMask];
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    recvArmed = False;
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    curBid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    curOff = 0;
+    curLen = cqe->res;
+  } else if (cqe->res == 0) {
+    recvEOF = True;
+  } else if (cqe->res != -ENOBUFS) {
+    /* ENOBUFS just means we were slow to return buffers; re-arm below. */
+    recvErrno = -cqe->res;
+  }
+
+  STORE(cqHead, head + 1);
+  return True;
+}
+
+
+/*
+ * InitUringReceive sets up io_uring for reading from sock.  Returns False,
+ * having cleaned up, if io_uring can't be used.
+ */
+
+Bool
+InitUringReceive(int sock)
+{
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t sqSize, cqSize;
+  char *sq, *cq;
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  ringFd = SysUringSetup(URING_ENTRIES, &p);
+  if (ringFd < 0) {
+    fprintf(stderr,"%s: io_uring not available (%s)\n",
+	    programName, strerror(errno));
+    return False;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    fprintf(stderr,"%s: io_uring too old\n",programName);
+    goto fail;
+  }
+
+  sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cqSize > sqSize)
+    sqSize = cqSize;
+
+  sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ringFd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  cq = sq;
+
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ringFd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+
+  sqTail = (unsigned *)(sq + p.sq_off.tail);
+  sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sqArray = (unsigned *)(sq + p.sq_off.array);
+  cqHead = (unsigned *)(cq + p.cq_off.head);
+  cqTail = (unsigned *)(cq + p.cq_off.tail);
+  cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* The buffer ring must be page aligned; the buffers needn't be, but it
+     does no harm. */
+  bufRing = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf),
+		 PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  bufs = mmap(NULL, (size_t)URING_NBUFS * URING_BUF_SIZE,
+	      PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (bufRing == MAP_FAILED || bufs == MAP_FAILED)
+    goto fail;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)bufRing;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = URING_BGID;
+  if (SysUringRegister(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    fprintf(stderr,"%s: io_uring provided buffers not supported (%s)\n",
+	    programName, strerror(errno));
+    goto fail;
+  }
+
+  for (i = 0; i < URING_NBUFS; i++)
+    RecycleBuffer(i);
+
+  ringSock = sock;
+  if (!ArmRecv())
+    goto fail;
+
+  fprintf(stderr,"Using io_uring receive path, %d x %dKB buffers\n",
+	  URING_NBUFS, URING_BUF_SIZE / 1024);
+  return True;
+
+ fail:
+  /* Unmapping is left to exit(); all that matters is that the socket is
+     no longer shared with a ring. */
+  close(ringFd);
+  ringFd = -1;
+  return False;
+}
+
+
+/*
+ * UringFd returns a descriptor which polls readable when UringReadv has data
+ * to return, or -1 if io_uring is not in use.
+ */
+
+int
+UringFd(void)
+{
+  return ringFd;
+}
+
+
+/*
+ * UringBuffered returns the number of received bytes held in the current
+ * buffer.  Further data may be waiting in the completion queue; that makes
+ * UringFd() readable.
+ */
+
+unsigned int
+UringBuffered(void)
+{
+  return curBid >= 0 ? curLen - curOff : 0;
+}
+
+
+/*
+ * UringReadv behaves like readv() on the socket: it blocks until some data
+ * is available and returns the number of bytes stored, 0 at end of stream,
+ * or -1 with errno set.
+ */
+
+int
+UringReadv(struct iovec *iov, int niov)
+{
+  int total = 0;
+  int i = 0;
+  unsigned int n;
+
+  while (total == 0) {
+    /* Copy from the current buffer, then from any further completions. */
+    while (i < niov) {
+      if (curBid < 0 && !ReapCompletion())
+	break;
+      if (curBid < 0)
+	continue;		/* a completion with no data */
+
+      n = curLen - curOff;
+      if (n > iov[i].iov_len)
+	n = iov[i].iov_len;
+      memcpy(iov[i].iov_base,
+	     bufs + (unsigned long)curBid * URING_BUF_SIZE + curOff, n);
+      iov[i].iov_base = (char *)iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+      if (iov[i].iov_len == 0)
+	i++;
+      total += n;
+      curOff += n;
+      if (curOff == curLen) {
+	RecycleBuffer(curBid);
+	curBid = -1;
+      }
+    }
+
+    if (total > 0)
+      break;
+
+    if (recvErrno) {
+      errno = recvErrno;
+      return -1;
+    }
+    if (recvEOF)
+      return 0;
+
+    if (!recvArmed && !ArmRecv())
+      return -1;
+
+    if (SysUringEnter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      fprintf(stderr,programName);
+      perror(": io_uring_enter");
+      return -1;
+    }
+  }
+
+  /* Keep a request outstanding so the kernel can receive while we decode. */
+  if (!recvArmed && !recvEOF && !recvErrno && !ArmRecv())
+    return -1;
+
+  return total;
+}
+
+#else /* no io_uring */
+
+Bool
+InitUringReceive(int sock)
+{
+  fprintf(stderr,"%s: built without io_uring support\n",programName);
+  return False;
+}
+
+int
+UringFd(void)
+{
+  return -1;
+}
+
+unsigned int
+UringBuffered(void)
+{
+  return 0;
+}
+
+int
+UringReadv(struct iovec *iov, int niov)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
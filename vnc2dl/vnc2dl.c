@@ -26,6 +26,38 @@
 
 char *programName;
 
+
+/*
+ * RFBSocketReady is called by the event loop when the server has sent us
+ * something.  A single read may bring in several messages, and the event loop
+ * only knows about the socket, so keep going while the receive buffer holds
+ * unprocessed data.
+ */
+
+static void
+RFBSocketReady(int fd, void *data)
+{
+  do {
+    if (!HandleRFBServerMessage()) {
+      QuitEventLoop();
+      return;
+    }
+  } while (RFBBytesBuffered() > 0);
+}
+
+
+/*
+ * FlushOutput runs once per pass of the event loop, so that everything we
+ * generated while handling events goes out in one write.
+ */
+
+static void
+FlushOutput(void)
+{
+  if (!FlushRFBMessages())
+    QuitEventLoop();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -40,6 +72,18 @@ main(int argc, char **argv)
   if (!InitialiseDevice()) exit(1);
   
 
+  /* With -fbfile we show a local framebuffer directly, and there is no VNC
+     server to talk to. */
+
+  if (appData.fbFile) {
+    if (appData.pipeline && !StartDeviceThread()) exit(1);
+    if (!StartFramebufferSource(appData.fbFile)) exit(1);
+    RunEventLoop();
+    ReleaseDevice();
+    return 0;
+  }
+
+
   /* The -listen option is used to make us a daemon process which listens for
      incoming connections from servers, rather than actively connecting to a
      given server. For -listen option, when a successful incoming connection has been accepted,
@@ -53,26 +97,71 @@ main(int argc, char **argv)
     if (!ConnectToRFBServer(vncServerHost, vncServerPort)) exit(1);
   }
 
+  /* With -pipeline, a thread of its own drives the device.  It is started
+     only now because -listen forks for each connection, and a thread
+     doesn't survive fork(). */
+
+  if (appData.pipeline && !StartDeviceThread()) exit(1);
+
+  TuneRFBSocket();
+
   /* Initialise the VNC connection, including reading the password */
 
   if (!InitialiseRFBConnection()) exit(1);
 
+  /* A desktop smaller than the device's usual mode gets a mode of its own
+     size if there is one.  If the desktop is bigger than the device, we
+     only show part of it. */
+
+  SelectDeviceMode(si.framebufferWidth, si.framebufferHeight);
+  InitViewport(si.framebufferWidth, si.framebufferHeight,
+               appData.viewportX, appData.viewportY);
+
+  /* Unless told which encodings to use, pick them to suit the link, and
+     keep adjusting them as it changes. */
+
+  if (!appData.encodingsString && !appData.noAutoSelect) StartAutoSelect();
+
   /* Tell the VNC server which pixel format and encodings we want to use */
 
   SetFormatAndEncodings();
 
   
+  /* With -stripes, the other connections are made now. */
+  if (!StartStripes()) exit(1);
+
+  /* With -control, settings can be changed from now on.  With -listen
+     there is a process for each connection, so each gets its own socket,
+     named after its process id. */
+  if (appData.controlPath && appData.listen) {
+    char *path = malloc(strlen(appData.controlPath) + 16);
+
+    sprintf(path, "%s.%d", appData.controlPath, (int)getpid());
+    appData.controlPath = path;
+  }
+  if (appData.controlPath && !StartControl(appData.controlPath)) exit(1);
+
   /* And kick things off */
-  SendIncrementalFramebufferUpdateRequest();
+  if (scheduling)
+    StartSchedule();
+  else
+    SendIncrementalFramebufferUpdateRequest();
   
-  /* Now enter the main loop, processing VNC messages. */
-  
-  while (1) {
-    if (!HandleRFBServerMessage())
-      break;
-  }
+  /* The handshake is done with plain reads; switch to io_uring only for the
+     bulk of the session. */
+
+  if (appData.ioUring) UseUringReceive();
+
+  /* Now enter the main loop, processing VNC messages as they arrive. */
+
+  if (!AddEventFd(RFBReadFd(), RFBSocketReady, NULL)) exit(1);
+  AddIdleProc(FlushOutput);
+
+  RunEventLoop();
 
   // Cleanup();
+  StopControl();
+  StopStripes();
   ReleaseDevice();
 
   return 0;
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <pwd.h>
 #include "rfbproto.h"
@@ -47,7 +48,24 @@ extern int endianTest;
 			     (((l) & 0x0000ff00) << 8)  | \
 			     (((l) & 0x000000ff) << 24))  : (l))
 
+/* Fetch big-endian protocol fields from a span returned by
+   PeekFromRFBServer.  The span need not be aligned. */
+
+#define RD_CARD8(p)  (((CARD8 *)(p))[0])
+#define RD_CARD16(p) ((CARD16)(((CARD8 *)(p))[0] << 8 | ((CARD8 *)(p))[1]))
+#define RD_CARD32(p) ((CARD32)((CARD32)((CARD8 *)(p))[0] << 24 | \
+			       (CARD32)((CARD8 *)(p))[1] << 16 | \
+			       (CARD32)((CARD8 *)(p))[2] << 8  | \
+			       (CARD32)((CARD8 *)(p))[3]))
+
+/* State belonging to one connection to the server.  With -stripes each
+   connection is handled by its own thread (see stripes.c). */
+#define PER_CONNECTION __thread
+
 #define MAX_ENCODINGS 20
+/* SendEncodings adds up to this many pseudo-encodings to a given list. */
+#define MAX_PSEUDO_ENCODINGS 10
+#define CURSOR_MAX_SIZE 128
 
 #define LISTEN_PORT_OFFSET 5500
 #define TUNNEL_PORT_OFFSET 5500
@@ -82,6 +100,26 @@ typedef struct {
   int qualityLevel;
   Bool enableJPEG;
   Bool autoPass;
+  Bool pipeline;
+  Bool ioUring;
+  char *listenUnix;
+  char *fbFile;
+  int fbInterval;
+  int rcvBuf;
+  Bool quickAck;
+  int statsInterval;
+  char *x509CA;
+  Bool noTLS;
+  Bool noContinuous;
+  Bool noAutoSelect;
+  int viewportX;
+  int viewportY;
+  Bool followPointer;
+  Bool useRemoteCursor;
+  int refineDelay;
+  int stripes;
+  int scale;
+  char *controlPath;
 } AppData;
 
 extern AppData appData;
@@ -93,36 +131,130 @@ extern int vncServerPort;
 extern void usage(void);
 extern void ProcessArgs(int argc, char **argv);
 
+/* autoselect.c */
+
+extern Bool autoSelect;
+
+extern void StartAutoSelect(void);
+extern int AutoSelectEncodings(CARD32 *encs, int max);
+extern void AutoSelectUpdateStart(void);
+extern void AutoSelectUpdateEnd(void);
+
+
+/* bandwidth.c */
+
+extern void SetBandwidth(int kbps);
+extern void BandwidthReceived(int bytes);
+extern long BandwidthWaitMs(void);
+extern double BandwidthMbps(void);
+
+
+/* control.c */
+
+extern Bool StartControl(const char *path);
+extern void StopControl(void);
+
+
+/* cursor.c */
+
+extern Bool HandleCursorShape(int xhot, int yhot, int width, int height,
+                              CARD32 enc);
+extern void SoftCursorMove(int x, int y);
+extern void SoftCursorLockArea(int x, int y, int w, int h);
+extern void SoftCursorUnlockScreen(void);
 
 /* dldevice.c */
 
 extern dlo_dev_t dl_uid; 
+extern int deviceWidth, deviceHeight;
+extern int viewportX, viewportY, viewportWidth, viewportHeight;
 extern Bool InitialiseDevice();
+extern Bool StartDeviceThread(void);
+extern void FlushDevice(void);
+extern long DeviceDrainMs(void);
+extern void InitViewport(int fbWidth, int fbHeight, int x, int y);
+extern Bool ClipToViewport(int *x, int *y, int *width, int *height);
+extern void MoveViewport(int x, int y);
+extern Bool SelectDeviceMode(int fbWidth, int fbHeight);
+extern void ResizeViewport(int fbWidth, int fbHeight);
+extern void SaveUnder(int x, int y, int width, int height);
+extern void RestoreUnder(int x, int y, int width, int height);
 extern void CopyDataToScreen(char *buf, int x, int y, int width, int height);
+extern void CopyStridedDataToScreen(char *buf, int stride, int x, int y,
+                                    int width, int height);
+extern void FillRect(int x, int y, int width, int height, CARD32 colour);
 extern void CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y);
+extern void ShareDevice(void);
+extern void LockDevice(void);
+extern void UnlockDevice(void);
 extern void ReleaseDevice();
 
+/* events.c */
+
+typedef void (*EventFdProc)(int fd, void *data);
+typedef void (*TimerProc)(void *data);
+typedef void (*IdleProc)(void);
+
+extern long CurrentTimeMs(void);
+extern Bool AddEventFd(int fd, EventFdProc proc, void *data);
+extern void RemoveEventFd(int fd);
+extern int AddTimer(long ms, Bool repeat, TimerProc proc, void *data);
+extern void RemoveTimer(int id);
+extern Bool AddIdleProc(IdleProc proc);
+extern void RunEventLoop(void);
+extern void QuitEventLoop(void);
+
+/* fbsource.c */
+
+extern Bool StartFramebufferSource(const char *path);
+
 /* listen.c */
 
 extern void listenForIncomingConnections();
 
+/* refine.c */
+
+extern void RefineMarkLossy(int x, int y, int w, int h);
+extern void RefineCovered(int x, int y, int w, int h);
+extern void RefineCopied(int srcX, int srcY, int w, int h, int dstX, int dstY);
+
+/* schedule.c */
+
+extern Bool scheduling;
+
+extern Bool AddPollRegion(const char *spec);
+extern void SetPollRate(int hz);
+extern Bool StopPollRate(void);
+extern void StartSchedule(void);
+extern void ScheduleChanged(int x, int y, int w, int h);
+extern void ScheduleUpdateDone(void);
+
 /* rfbproto.c */
 
-extern int rfbsock;
+extern PER_CONNECTION int rfbsock;
 extern Bool canUseCoRRE;
 extern Bool canUseHextile;
-extern char *desktopName;
+extern PER_CONNECTION char *desktopName;
 extern rfbPixelFormat myFormat;
-extern rfbServerInitMsg si;
-extern char *serverCutText;
-extern Bool newServerCutText;
+extern PER_CONNECTION rfbServerInitMsg si;
+extern PER_CONNECTION char *serverCutText;
+extern PER_CONNECTION Bool newServerCutText;
+extern PER_CONNECTION Bool continuousUpdates;
 
 extern Bool ConnectToRFBServer(const char *hostname, int port);
 extern Bool InitialiseRFBConnection();
 extern Bool SetFormatAndEncodings();
+extern Bool SendEncodings(void);
+extern void SetEncodingsString(const char *list);
+extern Bool EncodingSupported(CARD32 encoding);
+extern Bool SetLossless(Bool enable);
 extern Bool SendIncrementalFramebufferUpdateRequest();
+extern Bool PanViewport(int x, int y);
 extern Bool SendFramebufferUpdateRequest(int x, int y, int w, int h,
 					 Bool incremental);
+extern Bool SendEnableContinuousUpdates(Bool enable, int x, int y, int w, int h);
+extern Bool SendFence(CARD32 flags, int len, char *data);
+extern Bool ProbeRoundTrip(void);
 extern Bool SendPointerEvent(int x, int y, int buttonMask);
 extern Bool SendKeyEvent(CARD32 key, Bool down);
 extern Bool SendClientCutText(char *str, int len);
@@ -133,25 +265,73 @@ extern void PrintPixelFormat(rfbPixelFormat *format);
 
 /* sockets.c */
 
+/* A server name of the form unix:<path> means a Unix-domain socket. */
+#define UNIX_HOST_PREFIX "unix:"
+#define IsUnixHost(h) (strncmp((h), UNIX_HOST_PREFIX, sizeof(UNIX_HOST_PREFIX) - 1) == 0)
+
+#define RFB_MAX_PEEK (64*1024)
+
 extern Bool errorMessageOnReadFailure;
 
 extern Bool ReadFromRFBServer(char *out, unsigned int n);
+extern char *PeekFromRFBServer(unsigned int n);
+extern void ConsumeFromRFBServer(unsigned int n);
+extern unsigned int RFBBytesBuffered(void);
+extern unsigned long RFBBytesConsumed(void);
+extern long long RFBWaitUs(void);
+extern long RFBRoundTripMs(void);
+extern void TuneRFBSocket(void);
+extern Bool UseUringReceive(void);
+extern int RFBReadFd(void);
+extern Bool QueueRFBMessage(char *msg, int n);
+extern Bool QueueRFBData(char *data, int n);
+extern Bool FlushRFBMessages(void);
 extern Bool WriteExact(int sock, char *buf, int n);
 extern int FindFreeTcpPort(void);
 extern int ListenAtTcpPort(int port);
-extern int ConnectToTcpAddr(unsigned int host, int port);
+extern int ConnectToTcpHost(const char *host, int port);
 extern int AcceptTcpConnection(int listenSock);
+extern int ConnectToUnixAddr(const char *path);
+extern int ListenAtUnixPath(const char *path);
+extern int AcceptUnixConnection(int listenSock);
 extern Bool SetNonBlocking(int sock);
 
-extern int StringToIPAddr(const char *str, unsigned int *addr);
 extern Bool SameMachine(int sock);
 
+/* stripes.c */
+
+#define MAX_STRIPES 8
+
+extern PER_CONNECTION int stripeIndex;
+
+extern Bool StartStripes(void);
+extern void StopStripes(void);
+extern void StripesResendEncodings(void);
+extern void GetStripeBand(int *x, int *y, int *w, int *h);
+extern Bool InStripeBand(int x, int y, int w, int h);
+
+/* tls.c */
+
+extern PER_CONNECTION Bool tlsActive;
+
+extern Bool StartTLS(int sock, Bool anonymous);
+extern int TlsReadv(struct iovec *iov, int niov);
+extern Bool TlsWritev(struct iovec *iov, int niov);
+extern unsigned int TlsPending(void);
+
 /* tunnel.c */
 
 extern Bool tunnelSpecified;
 
 extern Bool createTunnel(int *argc, char **argv, int tunnelArgIndex);
 
+/* uring.c */
+
+extern Bool InitUringReceive(int sock);
+extern int UringFd(void);
+extern unsigned int UringBuffered(void);
+extern int UringReadv(struct iovec *iov, int niov);
+
 /* vnc2dl.c */
 
 extern char *programName;
@@ -30,6 +30,14 @@
 #define HandleZlibBPP CONCAT2E(HandleZlib,BPP)
 #define CARDBPP CONCAT2E(CARD,BPP)
 
+/*
+ * The rectangle is inflated a band of whole rows at a time into buffer, and
+ * each band goes to the device as soon as it is complete, so a large
+ * rectangle neither needs a buffer of its own nor waits to be drawn until
+ * the last of it has arrived.  The compressed data is inflated straight from
+ * the receive buffer.
+ */
+
 static Bool
 HandleZlibBPP (int rx, int ry, int rw, int rh)
 {
@@ -37,41 +45,29 @@ HandleZlibBPP (int rx, int ry, int rw, int rh)
   int remaining;
   int inflateResult;
   int toRead;
+  int rowBytes = rw * (BPP / 8);
+  int bandRows = 0, done = 0;
+  char *ptr;
 
-  /* First make sure we have a large enough raw buffer to hold the
-   * decompressed data.  In practice, with a fixed BPP, fixed frame
-   * buffer size and the first update containing the entire frame
-   * buffer, this buffer allocation should only happen once, on the
-   * first update.
-   */
-  if ( raw_buffer_size < (( rw * rh ) * ( BPP / 8 ))) {
-
-    if ( raw_buffer != NULL ) {
-
-      free( raw_buffer );
-
-    }
-
-    raw_buffer_size = (( rw * rh ) * ( BPP / 8 ));
-    raw_buffer = (char*) malloc( raw_buffer_size );
-
-  }
+  if (rowBytes == 0)
+    rh = 0;
+  else if ((bandRows = BUFFER_SIZE / rowBytes) > rh)
+    bandRows = rh;
 
   if (!ReadFromRFBServer((char *)&hdr, sz_rfbZlibHeader))
     return False;
 
   remaining = Swap32IfLE(hdr.nBytes);
 
-  /* Need to initialize the decompressor state. */
-  decompStream.next_in   = ( Bytef * )buffer;
-  decompStream.avail_in  = 0;
-  decompStream.next_out  = ( Bytef * )raw_buffer;
-  decompStream.avail_out = raw_buffer_size;
-  decompStream.data_type = Z_BINARY;
-
   /* Initialize the decompression stream structures on the first invocation. */
   if ( decompStreamInited == False ) {
 
+    decompStream.next_in  = Z_NULL;
+    decompStream.avail_in = 0;
+    decompStream.zalloc   = Z_NULL;
+    decompStream.zfree    = Z_NULL;
+    decompStream.opaque   = Z_NULL;
+
     inflateResult = inflateInit( &decompStream );
 
     if ( inflateResult != Z_OK ) {
@@ -86,71 +82,85 @@ HandleZlibBPP (int rx, int ry, int rw, int rh)
 
   }
 
-  inflateResult = Z_OK;
+  /* Once the rectangle is complete, the rest of the data should only be the
+     end of the flush, which has no output: the whole of buffer is then
+     left as room, to catch anything more. */
+  decompStream.next_out  = ( Bytef * )buffer;
+  decompStream.avail_out = ( rh > 0 ) ? bandRows * rowBytes : BUFFER_SIZE;
+
+  /* Process the data a peek at a time until no more to process. */
+  while ( remaining > 0 ) {
 
-  /* Process buffer full of data until no more to process, or
-   * some type of inflater error, or Z_STREAM_END.
-   */
-  while (( remaining > 0 ) &&
-         ( inflateResult == Z_OK )) {
-  
-    if ( remaining > BUFFER_SIZE ) {
-      toRead = BUFFER_SIZE;
+    if ( remaining > RFB_MAX_PEEK ) {
+      toRead = RFB_MAX_PEEK;
     }
     else {
       toRead = remaining;
     }
 
-    /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(buffer,toRead))
+    if ((ptr = PeekFromRFBServer(toRead)) == NULL)
       return False;
 
-    decompStream.next_in  = ( Bytef * )buffer;
+    decompStream.next_in  = ( Bytef * )ptr;
     decompStream.avail_in = toRead;
 
-    /* Need to uncompress buffer full. */
-    inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
-
-    /* We never supply a dictionary for compression. */
-    if ( inflateResult == Z_NEED_DICT ) {
-      fprintf(stderr,"zlib inflate needs a dictionary!\n");
-      return False;
-    }
-    if ( inflateResult < 0 ) {
-      fprintf(stderr,
-              "zlib inflate returned error: %d, msg: %s\n",
-              inflateResult,
-              decompStream.msg);
-      return False;
-    }
+    while ( decompStream.avail_in > 0 ) {
+
+      inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
+
+      /* We never supply a dictionary for compression. */
+      if ( inflateResult == Z_NEED_DICT ) {
+        fprintf(stderr,"zlib inflate needs a dictionary!\n");
+        return False;
+      }
+      if ( inflateResult < 0 && inflateResult != Z_BUF_ERROR ) {
+        fprintf(stderr,
+                "zlib inflate returned error: %d, msg: %s\n",
+                inflateResult,
+                decompStream.msg);
+        return False;
+      }
+
+      if ( done == rh ) {
+        if (( char * )decompStream.next_out != buffer ) {
+          fprintf(stderr,"zlib inflate ran out of space!\n");
+          return False;
+        }
+      }
+      else if ( decompStream.avail_out == 0 ) {
+        /* The band is full: put it on the screen and start the next. */
+        CopyDataToScreen(buffer, rx, ry + done, rw, bandRows);
+        done += bandRows;
+        if ( bandRows > rh - done )
+          bandRows = rh - done;
+
+        decompStream.next_out  = ( Bytef * )buffer;
+        decompStream.avail_out = ( done < rh ) ? bandRows * rowBytes
+                                               : BUFFER_SIZE;
+        continue;
+      }
+
+      /* Room to spare and input left, but no progress. */
+      if ( inflateResult == Z_BUF_ERROR || inflateResult == Z_STREAM_END ) {
+        fprintf(stderr,
+                "zlib inflate returned error: %d, msg: %s\n",
+                inflateResult,
+                decompStream.msg);
+        return False;
+      }
 
-    /* Result buffer allocated to be at least large enough.  We should
-     * never run out of space!
-     */
-    if (( decompStream.avail_in > 0 ) &&
-        ( decompStream.avail_out <= 0 )) {
-      fprintf(stderr,"zlib inflate ran out of space!\n");
-      return False;
     }
 
+    ConsumeFromRFBServer(toRead);
     remaining -= toRead;
 
   } /* while ( remaining > 0 ) */
 
-  if ( inflateResult == Z_OK ) {
-
-    /* Put the uncompressed contents of the update on the screen. */
-    CopyDataToScreen(raw_buffer, rx, ry, rw, rh);
-
-  }
-  else {
-
-    fprintf(stderr,
-            "zlib inflate returned error: %d, msg: %s\n",
-            inflateResult,
-            decompStream.msg);
-    return False;
-
+  /* Draw the complete rows of a last band the server cut short. */
+  if ( done < rh &&
+       ( char * )decompStream.next_out - buffer >= rowBytes ) {
+    CopyDataToScreen(buffer, rx, ry + done, rw,
+                     (( char * )decompStream.next_out - buffer) / rowBytes);
   }
 
   return True;